@@ -0,0 +1,219 @@
+// Logical channel scheduler check and microbenchmark: channel.c runs over a
+// link layer kept in memory, which records the channel of every fragment.
+// Checks that two backlogged channels of weights 3 and 1 share the line 3:1,
+// that a command queued behind a bulk transfer goes out within one round, and
+// that every message comes out of chread() whole and on its channel; then
+// times the scheduler and reassembly per fragment.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "channel.h"
+
+#define MAX_FRAGMENTS 4096
+#define BULK_MESSAGES CH_QUEUE_SIZE
+#define BULK_SIZE (4 * CH_MAX_FRAGMENT)
+#define COMMAND_SIZE 16
+#define ITERATIONS 2000
+
+// The link: fragments written and not yet read, in order
+static struct
+{
+    unsigned char data[MAX_FRAGMENTS][MAX_PAYLOAD_SIZE];
+    int size[MAX_FRAGMENTS];
+    int head;
+    int count;
+    int written;
+} line;
+
+int llchannels(void)
+{
+    return 2;
+}
+
+int llmaxpayload(void)
+{
+    return MAX_PAYLOAD_SIZE;
+}
+
+int llwritejumbo(const unsigned char *buf, int bufSize)
+{
+    if (line.count == MAX_FRAGMENTS || bufSize > MAX_PAYLOAD_SIZE)
+    {
+        return -1;
+    }
+    int tail = (line.head + line.count) % MAX_FRAGMENTS;
+    memcpy(line.data[tail], buf, bufSize);
+    line.size[tail] = bufSize;
+    line.count++;
+    line.written++;
+    return bufSize;
+}
+
+int llreadjumbo(unsigned char *packet, int packetSize)
+{
+    if (line.count == 0 || line.size[line.head] > packetSize)
+    {
+        return -1;
+    }
+    int size = line.size[line.head];
+    memcpy(packet, line.data[line.head], size);
+    line.head = (line.head + 1) % MAX_FRAGMENTS;
+    line.count--;
+    return size;
+}
+
+// Channel of the fragment "index" places behind the oldest one on the line.
+static int fragmentChannel(int index)
+{
+    return line.data[(line.head + index) % MAX_FRAGMENTS][0] & ~CH_LAST;
+}
+
+static void fillMessage(unsigned char *buf, int size, int channel, int number)
+{
+    for (int i = 0; i < size; i++)
+    {
+        buf[i] = channel * 97 + number * 31 + i;
+    }
+}
+
+static double elapsedNs(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+// Queue the bulk messages of both channels, send them and read them back,
+// checking the share of the line while both were backlogged and the contents.
+// Return the number of errors found.
+static int checkWeights(unsigned char *buf, unsigned char *packet)
+{
+    int errors = 0;
+    chopen();
+    chsetweight(0, 3);
+    chsetweight(1, 1);
+    for (int number = 0; number < BULK_MESSAGES; number++)
+    {
+        for (int channel = 0; channel < 2; channel++)
+        {
+            fillMessage(buf, BULK_SIZE, channel, number);
+            chwrite(channel, buf, BULK_SIZE);
+        }
+    }
+    chflush();
+
+    // Channel 0 sends three times as fast and runs out first: count whole
+    // rounds of the first as many fragments as each channel has
+    int fragments[2] = {0, 0};
+    int perChannel = BULK_MESSAGES * BULK_SIZE / CH_MAX_FRAGMENT;
+    for (int i = 0; i < perChannel / 4 * 4; i++)
+    {
+        fragments[fragmentChannel(i)]++;
+    }
+    printf("Weights 3:1, both backlogged: %d fragments on channel 0, %d on channel 1\n", fragments[0],
+           fragments[1]);
+    if (fragments[0] != 3 * fragments[1])
+    {
+        printf("  FAILED: expected a 3:1 share\n");
+        errors++;
+    }
+
+    int received[2] = {0, 0};
+    while (line.count > 0)
+    {
+        int channel;
+        int size = chread(&channel, packet, CH_MAX_MESSAGE);
+        fillMessage(buf, BULK_SIZE, channel, received[channel]);
+        if (size != BULK_SIZE || memcmp(packet, buf, BULK_SIZE) != 0)
+        {
+            printf("  FAILED: message %d of channel %d reassembled wrong\n", received[channel], channel);
+            errors++;
+        }
+        received[channel]++;
+    }
+    if (received[0] != BULK_MESSAGES || received[1] != BULK_MESSAGES)
+    {
+        printf("  FAILED: %d and %d messages received\n", received[0], received[1]);
+        errors++;
+    }
+    chclose();
+    return errors;
+}
+
+// Queue a full bulk channel and then a command on the other, and check that
+// the command goes out within the bulk channel's first turn.
+// Return the number of errors found.
+static int checkLatency(unsigned char *buf, unsigned char *packet)
+{
+    int errors = 0;
+    chopen();
+    chsetweight(0, 4);
+    for (int number = 0; number < BULK_MESSAGES; number++)
+    {
+        fillMessage(buf, BULK_SIZE, 0, number);
+        chwrite(0, buf, BULK_SIZE);
+    }
+    fillMessage(buf, COMMAND_SIZE, 1, 0);
+    chwrite(1, buf, COMMAND_SIZE);
+    chflush();
+
+    int position = 0;
+    while (position < line.count && fragmentChannel(position) != 1)
+    {
+        position++;
+    }
+    printf("Command behind %d bulk bytes of weight 4: sent after %d fragments\n", BULK_MESSAGES * BULK_SIZE,
+           position);
+    if (position > 4)
+    {
+        printf("  FAILED: expected at most 4\n");
+        errors++;
+    }
+
+    while (line.count > 0)
+    {
+        int channel;
+        chread(&channel, packet, CH_MAX_MESSAGE);
+    }
+    chclose();
+    return errors;
+}
+
+int main(void)
+{
+    unsigned char *buf = malloc(CH_MAX_MESSAGE);
+    unsigned char *packet = malloc(CH_MAX_MESSAGE);
+    if (buf == NULL || packet == NULL)
+    {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    int errors = checkWeights(buf, packet);
+    errors += checkLatency(buf, packet);
+
+    // Scheduling and reassembly cost, without the link's
+    struct timespec start, end;
+    line.written = 0;
+    chopen();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        chwrite(0, buf, BULK_SIZE);
+        chwrite(1, buf, BULK_SIZE);
+        chflush();
+        int channel;
+        chread(&channel, packet, CH_MAX_MESSAGE);
+        chread(&channel, packet, CH_MAX_MESSAGE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    chclose();
+    printf("\nScheduling and reassembly: %.1f ns per %d-byte fragment\n",
+           elapsedNs(&start, &end) / line.written, CH_MAX_FRAGMENT);
+
+    free(buf);
+    free(packet);
+    printf("%s\n", errors == 0 ? "All checks passed" : "Some checks FAILED");
+    return errors != 0;
+}
@@ -0,0 +1,119 @@
+// Data packet compression: for each file given, split in blocks the size of
+// the largest default data packet, the share of blocks that compress, the size
+// on the link and the compression and decompression speeds. Decompressed
+// blocks are checked against the input.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compress.h"
+#include "link_layer.h"
+
+// File bytes in a data packet after C, L2, L1, and the compressed packets'
+// two extra header bytes
+#define BLOCK_SIZE (MAX_PAYLOAD_SIZE - 3)
+#define EXTRA_HEADER_SIZE 2
+
+#define MAX_FILE_SIZE (16 * 1024 * 1024)
+#define MIN_BYTES (64 * 1024 * 1024)
+
+static double elapsedNs(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char *argv[])
+{
+    static unsigned char data[MAX_FILE_SIZE];
+    static unsigned char compressed[MAX_FILE_SIZE];
+    static int compressedSizes[MAX_FILE_SIZE / BLOCK_SIZE + 1];
+    static unsigned char block[BLOCK_SIZE];
+
+    if (argc < 2)
+    {
+        printf("Usage: %s <file>...\n", argv[0]);
+        return 1;
+    }
+
+    printf("%d-byte blocks\n\n", BLOCK_SIZE);
+    printf("%-28s %10s %10s %10s %12s %12s\n", "file", "bytes", "on link", "packed", "comp MB/s",
+           "decomp MB/s");
+
+    for (int f = 1; f < argc; f++)
+    {
+        FILE *file = fopen(argv[f], "rb");
+        if (file == NULL)
+        {
+            perror(argv[f]);
+            return 1;
+        }
+        int size = fread(data, 1, MAX_FILE_SIZE, file);
+        fclose(file);
+        if (size <= 0)
+        {
+            continue;
+        }
+
+        int blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int iterations = MIN_BYTES / size + 1;
+        struct timespec start, end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < iterations; i++)
+        {
+            for (int b = 0; b < blocks; b++)
+            {
+                int blockSize = b < blocks - 1 ? BLOCK_SIZE : size - b * BLOCK_SIZE;
+                compressedSizes[b] = compressBlock(data + b * BLOCK_SIZE, blockSize, compressed + b * BLOCK_SIZE,
+                                                   blockSize - EXTRA_HEADER_SIZE - 1);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double compressNs = elapsedNs(&start, &end) / iterations;
+
+        long onLink = 0;
+        long packedBytes = 0;
+        int packed = 0;
+        for (int b = 0; b < blocks; b++)
+        {
+            int blockSize = b < blocks - 1 ? BLOCK_SIZE : size - b * BLOCK_SIZE;
+            if (compressedSizes[b] >= 0)
+            {
+                onLink += compressedSizes[b] + EXTRA_HEADER_SIZE;
+                packedBytes += blockSize;
+                packed++;
+            }
+            else
+            {
+                onLink += blockSize;
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < iterations; i++)
+        {
+            for (int b = 0; b < blocks; b++)
+            {
+                int blockSize = b < blocks - 1 ? BLOCK_SIZE : size - b * BLOCK_SIZE;
+                if (compressedSizes[b] >= 0 &&
+                    (decompressBlock(compressed + b * BLOCK_SIZE, compressedSizes[b], block, blockSize) != blockSize ||
+                     memcmp(block, data + b * BLOCK_SIZE, blockSize) != 0))
+                {
+                    printf("%s: block %d does not decompress to the input\n", argv[f], b);
+                    return 1;
+                }
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double decompressNs = elapsedNs(&start, &end) / iterations;
+
+        char packedShare[32];
+        snprintf(packedShare, sizeof(packedShare), "%d/%d", packed, blocks);
+        printf("%-28s %10d %10ld %10s %12.1f %12.1f\n", argv[f], size, onLink, packedShare, size / compressNs * 1e3,
+               packedBytes > 0 ? packedBytes / decompressNs * 1e3 : 0.0);
+    }
+
+    return 0;
+}
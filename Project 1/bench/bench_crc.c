@@ -0,0 +1,137 @@
+// Frame check microbenchmark: XOR BCC2 versus CRC-16 and CRC-32.
+// Measures the time to check one frame and how many corrupted frames each
+// check fails to detect.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "crc.h"
+#include "link_layer.h"
+
+#define ITERATIONS 200000
+#define ERROR_TRIALS 1000000
+
+static unsigned int sink;
+
+// The XOR BCC2 from TP3/read_noncanonical.c
+static unsigned char calculate_bcc(const unsigned char *data, int length)
+{
+    unsigned char bcc = 0;
+    for (int i = 0; i < length; i++)
+    {
+        bcc ^= data[i];
+    }
+    return bcc;
+}
+
+static unsigned int checkXor(const unsigned char *buf, size_t size)
+{
+    return calculate_bcc(buf, size);
+}
+
+static unsigned int checkCrc16(const unsigned char *buf, size_t size)
+{
+    return crc16Update(CRC16_INIT, buf, size);
+}
+
+static unsigned int checkCrc32Portable(const unsigned char *buf, size_t size)
+{
+    return crc32UpdatePortable(CRC32_INIT, buf, size);
+}
+
+static unsigned int checkCrc32(const unsigned char *buf, size_t size)
+{
+    return crc32Update(CRC32_INIT, buf, size);
+}
+
+typedef struct
+{
+    const char *name;
+    unsigned int (*check)(const unsigned char *, size_t);
+} Check;
+
+static const Check checks[] = {
+    {"xor", checkXor},
+    {"crc16 (slicing-by-8)", checkCrc16},
+    {"crc32 (slicing-by-8)", checkCrc32Portable},
+    {"crc32 (dispatched)", checkCrc32},
+};
+
+#define N_CHECKS (int) (sizeof(checks) / sizeof(checks[0]))
+
+static double elapsedNs(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+int main(void)
+{
+    static unsigned char frame[MAX_PAYLOAD_SIZE];
+    srand(1);
+    for (int i = 0; i < MAX_PAYLOAD_SIZE; i++)
+    {
+        frame[i] = rand();
+    }
+
+    printf("Frame check of a %d-byte payload, %d iterations\n\n", MAX_PAYLOAD_SIZE, ITERATIONS);
+    printf("%-22s %12s %12s\n", "check", "ns/frame", "MB/s");
+
+    for (int c = 0; c < N_CHECKS; c++)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < ITERATIONS; i++)
+        {
+            frame[i % MAX_PAYLOAD_SIZE] ^= 1; // Keep the compiler from hoisting the call
+            sink += checks[c].check(frame, MAX_PAYLOAD_SIZE);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double ns = elapsedNs(&start, &end) / ITERATIONS;
+        printf("%-22s %12.1f %12.1f\n", checks[c].name, ns, MAX_PAYLOAD_SIZE / ns * 1e3);
+    }
+
+    // Undetected errors: flip 2 to 8 random bits and see if the check changes
+    printf("\nUndetected corruptions out of %d frames with 2-8 flipped bits\n\n", ERROR_TRIALS);
+    printf("%-22s %12s\n", "check", "undetected");
+
+    for (int c = 0; c < N_CHECKS; c++)
+    {
+        unsigned int reference = checks[c].check(frame, MAX_PAYLOAD_SIZE);
+        long undetected = 0;
+        int positions[8];
+
+        for (int trial = 0; trial < ERROR_TRIALS; trial++)
+        {
+            int flips = 2 + rand() % 7;
+            for (int f = 0; f < flips; f++)
+            {
+                positions[f] = rand() % (MAX_PAYLOAD_SIZE * 8);
+                frame[positions[f] / 8] ^= 1 << (positions[f] % 8);
+            }
+            // Flips may cancel out; only count frames that actually differ
+            int changed = FALSE;
+            for (int f = 0; f < flips && !changed; f++)
+            {
+                int count = 0;
+                for (int g = 0; g < flips; g++)
+                {
+                    count += positions[g] == positions[f];
+                }
+                changed = count % 2 == 1;
+            }
+            if (changed && checks[c].check(frame, MAX_PAYLOAD_SIZE) == reference)
+            {
+                undetected++;
+            }
+            for (int f = 0; f < flips; f++)
+            {
+                frame[positions[f] / 8] ^= 1 << (positions[f] % 8);
+            }
+        }
+        printf("%-22s %12ld\n", checks[c].name, undetected);
+    }
+
+    return sink == 0xFFFFFFFF;
+}
@@ -0,0 +1,128 @@
+// Reed-Solomon RS(255,223) throughput: encoding, and decoding with no errors,
+// a few and the most errors each codeword corrects, for every GF(256)
+// multiply-accumulate kernel. Decoded payloads are checked against the input.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fec.h"
+#include "link_layer.h"
+
+#define PAYLOAD_SIZE (4 * MAX_PAYLOAD_SIZE)
+#define ITERATIONS 2000
+
+static unsigned int sink;
+
+typedef struct
+{
+    const char *name;
+    FecKernel kernel;
+} Kernel;
+
+static const Kernel kernels[] = {
+    {"scalar", FecScalar},
+    {"ssse3", FecSsse3},
+    {"avx2", FecAvx2},
+};
+
+#define N_KERNELS (int) (sizeof(kernels) / sizeof(kernels[0]))
+
+// Errors put in each codeword before decoding
+static const int errorCounts[] = {0, 4, FEC_PARITY / 2};
+
+#define N_ERROR_COUNTS (int) (sizeof(errorCounts) / sizeof(errorCounts[0]))
+
+static double elapsedNs(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+// Corrupt "errors" distinct bytes of each codeword of an encoded payload,
+// whose codewords are interleaved byte by byte.
+static void corrupt(unsigned char *encoded, int payloadSize, int errors)
+{
+    int codewords = FEC_CODEWORDS(payloadSize);
+    for (int k = 0; k < codewords; k++)
+    {
+        int size = payloadSize / codewords + (k < payloadSize % codewords) + FEC_PARITY;
+        int stride = size / errors;
+        for (int e = 0; e < errors; e++)
+        {
+            encoded[(e * stride + rand() % stride) * codewords + k] ^= 1 + rand() % 255;
+        }
+    }
+}
+
+int main(void)
+{
+    static unsigned char payload[PAYLOAD_SIZE];
+    static unsigned char encoded[FEC_ENCODED_SIZE(PAYLOAD_SIZE)];
+    static unsigned char corrupted[FEC_ENCODED_SIZE(PAYLOAD_SIZE)];
+    static unsigned char decoded[PAYLOAD_SIZE];
+    srand(1);
+
+    for (int i = 0; i < PAYLOAD_SIZE; i++)
+    {
+        payload[i] = rand();
+    }
+
+    printf("RS(%d,%d) on a %d-byte payload (%d codewords), %d iterations (best kernel: %s)\n\n",
+           FEC_CODEWORD, FEC_DATA, PAYLOAD_SIZE, FEC_CODEWORDS(PAYLOAD_SIZE), ITERATIONS,
+           kernels[fecBestKernel()].name);
+
+    struct timespec start, end;
+    size_t encodedSize = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        encodedSize = fecEncode(payload, PAYLOAD_SIZE, 1, encoded);
+        sink += encoded[i % encodedSize];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("encode: %.1f MB/s\n\n", PAYLOAD_SIZE / (elapsedNs(&start, &end) / ITERATIONS) * 1e3);
+
+    printf("%-8s %-18s %12s\n", "kernel", "errors/codeword", "decode MB/s");
+    for (int k = 0; k < N_KERNELS; k++)
+    {
+        if (fecSelectKernel(kernels[k].kernel) < 0)
+        {
+            printf("%-8s %-18s %12s\n", kernels[k].name, "-", "n/a");
+            continue;
+        }
+
+        for (int e = 0; e < N_ERROR_COUNTS; e++)
+        {
+            memcpy(corrupted, encoded, encodedSize);
+            if (errorCounts[e] > 0)
+            {
+                corrupt(corrupted, PAYLOAD_SIZE, errorCounts[e]);
+            }
+
+            size_t messageSize = 0;
+            int corrected = 0;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int i = 0; i < ITERATIONS; i++)
+            {
+                corrected = fecDecode(corrupted, encodedSize, 1, decoded, &messageSize);
+                sink += decoded[i % PAYLOAD_SIZE];
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double ns = elapsedNs(&start, &end);
+
+            if (corrected != errorCounts[e] * FEC_CODEWORDS(PAYLOAD_SIZE) || messageSize != PAYLOAD_SIZE ||
+                memcmp(decoded, payload, PAYLOAD_SIZE) != 0)
+            {
+                printf("%s kernel: decoding failed with %d errors per codeword\n", kernels[k].name, errorCounts[e]);
+                return 1;
+            }
+
+            char errors[32];
+            snprintf(errors, sizeof(errors), "%d", errorCounts[e]);
+            printf("%-8s %-18s %12.1f\n", kernels[k].name, errors, PAYLOAD_SIZE / (ns / ITERATIONS) * 1e3);
+        }
+    }
+
+    return sink == 0xFFFFFFFF;
+}
@@ -0,0 +1,528 @@
+// End-to-end efficiency over the virtual cable: starts the cable, then for
+// every combination of baud rate, bit error rate, propagation delay, frame size
+// and ARQ scheme sets up the cable, transfers each file with a receiver and a
+// transmitter, checks the copy with cmp and appends the transmitter's link
+// statistics (APP_STATS) to a CSV file. Frames are checked with CRC-32 unless
+// LL_CHECK says otherwise, so that corrupted frames are not taken for good
+// ones at high bit error rates. Other LL_ and APP_ variables pass through, so
+// options not swept here are compared by running it again.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "link_layer.h"
+
+#define TX_SERIAL_PORT "/dev/ttyS10"
+#define RX_SERIAL_PORT "/dev/ttyS11"
+
+#define MAX_VALUES 16
+#define MAX_PATH 512
+
+// The cable reads each command with a single read(), so commands are sent
+// one at a time and given time to be taken
+#define COMMAND_GAP_US 200000
+#define CABLE_START_S 10
+#define RECEIVER_START_US 300000
+
+// Time allowed for a transfer on top of RUN_SLACK times the ideal one
+#define RUN_TIMEOUT_S 30
+#define RUN_SLACK 5
+
+typedef struct
+{
+    char *text[MAX_VALUES];
+    int count;
+} ValueList;
+
+typedef struct
+{
+    const char *mainPath;
+    const char *cablePath;
+    const char *csvPath;
+    const char *seed; // Of the cable's noise, restarted for every run
+    ValueList bauds;
+    ValueList bers;
+    ValueList props;
+    ValueList frameSizes;
+    ValueList arqs;
+} Config;
+
+// One transfer, and what the transmitter's statistics say about it.
+typedef struct
+{
+    const char *file;
+    long fileSize;
+    const char *arq;
+    long baud;
+    const char *ber;
+    long prop;
+    int frameSize;
+
+    int ok;
+    double seconds;
+    double goodput;
+    double efficiency;
+    double theoretical; // Negative if unknown
+    long retransmissions;
+    long timeouts;
+    double frameErrorRatio;
+} Run;
+
+static FILE *cableInput;
+static pid_t cablePid;
+
+static double nowS(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Split the comma-separated "text" into "list".
+// Return "0" on success or "-1" if there are too many values.
+static int parseList(char *text, ValueList *list)
+{
+    list->count = 0;
+    for (char *value = strtok(text, ","); value != NULL; value = strtok(NULL, ","))
+    {
+        if (list->count == MAX_VALUES)
+        {
+            return -1;
+        }
+        list->text[list->count++] = value;
+    }
+    return list->count > 0 ? 0 : -1;
+}
+
+static long fileSize(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+// Compare both files with cmp.
+// Return "1" if they have the same contents, "0" otherwise.
+static int sameContents(const char *path1, const char *path2)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        return FALSE;
+    }
+    if (pid == 0)
+    {
+        execlp("cmp", "cmp", "-s", path1, path2, (char *) NULL);
+        perror("cmp");
+        _exit(127);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Remove "workDir" and the files the runs left in it.
+static void removeWorkDir(const char *workDir)
+{
+    DIR *dir = opendir(workDir);
+    if (dir != NULL)
+    {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            char path[MAX_PATH];
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            {
+                snprintf(path, sizeof(path), "%s/%s", workDir, entry->d_name);
+                unlink(path);
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(workDir);
+}
+
+static void cableCommand(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+static void cableCommand(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vfprintf(cableInput, format, args);
+    va_end(args);
+    fputc('\n', cableInput);
+    fflush(cableInput);
+    usleep(COMMAND_GAP_US);
+}
+
+// Set the noise of the line from a bit error rate, or from a Gilbert-Elliott
+// model written "ge/<good ber>/<bad ber>/<p good->bad>/<p bad->good>".
+static void setNoise(const char *noise)
+{
+    if (strncmp(noise, "ge/", 3) != 0)
+    {
+        cableCommand("ber %s", noise);
+        return;
+    }
+
+    char command[MAX_PATH];
+    snprintf(command, sizeof(command), "ge %s", noise + 3);
+    for (char *slash = strchr(command, '/'); slash != NULL; slash = strchr(slash, '/'))
+    {
+        *slash = ' ';
+    }
+    cableCommand("%s", command);
+}
+
+// Start the cable with its output in "logPath" and wait for its ports.
+// Return "0" on success or "-1" on error.
+static int startCable(const char *cablePath, const char *logPath)
+{
+    int pipeFds[2];
+    if (pipe(pipeFds) < 0)
+    {
+        perror("pipe");
+        return -1;
+    }
+
+    // Ports left by an earlier cable would pass for the new ones
+    unlink(TX_SERIAL_PORT);
+    unlink(RX_SERIAL_PORT);
+
+    cablePid = fork();
+    if (cablePid < 0)
+    {
+        perror("fork");
+        return -1;
+    }
+    if (cablePid == 0)
+    {
+        int log = open(logPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(pipeFds[0], STDIN_FILENO);
+        if (log >= 0)
+        {
+            dup2(log, STDOUT_FILENO);
+            dup2(log, STDERR_FILENO);
+        }
+        close(pipeFds[1]);
+        execl(cablePath, cablePath, (char *) NULL);
+        perror(cablePath);
+        _exit(127);
+    }
+
+    close(pipeFds[0]);
+    cableInput = fdopen(pipeFds[1], "w");
+
+    double deadline = nowS() + CABLE_START_S;
+    while (access(TX_SERIAL_PORT, F_OK) != 0 || access(RX_SERIAL_PORT, F_OK) != 0)
+    {
+        if (nowS() > deadline || waitpid(cablePid, NULL, WNOHANG) != 0)
+        {
+            printf("The cable did not start, see %s\n", logPath);
+            return -1;
+        }
+        usleep(100000);
+    }
+
+    // The cable opens its own ends of the ports after creating them
+    sleep(1);
+    return 0;
+}
+
+static void stopCable(void)
+{
+    if (cableInput != NULL)
+    {
+        cableCommand("quit");
+        fclose(cableInput);
+        cableInput = NULL;
+    }
+    if (cablePid > 0)
+    {
+        waitpid(cablePid, NULL, 0);
+        cablePid = 0;
+    }
+}
+
+// Start bin/main on "port" with the run's options in its environment.
+static pid_t startMain(const Config *config, const Run *run, const char *port, const char *role,
+                       const char *file, const char *statsPath)
+{
+    pid_t pid = fork();
+    if (pid != 0)
+    {
+        if (pid < 0)
+        {
+            perror("fork");
+        }
+        return pid;
+    }
+
+    char value[32];
+    setenv("LL_ARQ", run->arq, TRUE);
+    snprintf(value, sizeof(value), "%ld", run->baud);
+    setenv("LL_BAUD", value, TRUE);
+    snprintf(value, sizeof(value), "%d", run->frameSize > MAX_PAYLOAD_SIZE ? run->frameSize : MAX_PAYLOAD_SIZE);
+    setenv("LL_MAX_PAYLOAD", value, TRUE);
+    snprintf(value, sizeof(value), "%d", run->frameSize);
+    setenv("APP_PACKET_SIZE", value, TRUE);
+    setenv("APP_STATS", statsPath, TRUE);
+
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0)
+    {
+        dup2(null, STDOUT_FILENO);
+    }
+    execl(config->mainPath, config->mainPath, port, role, file, (char *) NULL);
+    perror(config->mainPath);
+    _exit(127);
+}
+
+// Wait for "pid" until "deadline", killing it then. main() exits with 0 even
+// when the transfer fails, so its status says nothing; the copy is compared.
+// Return "1" if it finished in time, "0" otherwise.
+static int waitMain(pid_t pid, double deadline)
+{
+    while (waitpid(pid, NULL, WNOHANG) == 0)
+    {
+        if (nowS() > deadline)
+        {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+            return FALSE;
+        }
+        usleep(20000);
+    }
+    return TRUE;
+}
+
+// Value of "key" in the flat JSON object "json", "fallback" if missing or null.
+static double jsonNumber(const char *json, const char *key, double fallback)
+{
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char *found = strstr(json, pattern);
+    if (found == NULL)
+    {
+        return fallback;
+    }
+    char *end;
+    double value = strtod(found + strlen(pattern), &end);
+    return end == found + strlen(pattern) ? fallback : value;
+}
+
+// Fill in the results of "run" from the statistics the transmitter wrote.
+static void readStatistics(Run *run, const char *statsPath)
+{
+    char json[4096] = {0};
+    FILE *file = fopen(statsPath, "r");
+    if (file == NULL)
+    {
+        run->theoretical = -1;
+        return;
+    }
+    fread(json, 1, sizeof(json) - 1, file);
+    fclose(file);
+
+    run->seconds = jsonNumber(json, "seconds", 0);
+    run->goodput = jsonNumber(json, "goodputSent", 0);
+    run->efficiency = jsonNumber(json, "efficiency", 0);
+    run->theoretical = jsonNumber(json, "theoreticalEfficiency", -1);
+    run->retransmissions = jsonNumber(json, "retransmissions", 0);
+    run->timeouts = jsonNumber(json, "timeouts", 0);
+    run->frameErrorRatio = jsonNumber(json, "frameErrorRatio", 0);
+}
+
+// Transfer the run's file through the cable as it is set up.
+static void transfer(const Config *config, Run *run, const char *workDir)
+{
+    char received[MAX_PATH];
+    char rxStats[MAX_PATH];
+    char txStats[MAX_PATH];
+    snprintf(received, sizeof(received), "%s/received", workDir);
+    snprintf(rxStats, sizeof(rxStats), "%s/rx.json", workDir);
+    snprintf(txStats, sizeof(txStats), "%s/tx.json", workDir);
+    unlink(received);
+    unlink(txStats);
+
+    double ideal = run->fileSize * 10.0 / run->baud;
+    double deadline = nowS() + RUN_TIMEOUT_S + RUN_SLACK * ideal;
+
+    pid_t rx = startMain(config, run, RX_SERIAL_PORT, "rx", received, rxStats);
+    usleep(RECEIVER_START_US);
+    pid_t tx = startMain(config, run, TX_SERIAL_PORT, "tx", run->file, txStats);
+
+    int txDone = tx > 0 && waitMain(tx, deadline);
+    int rxDone = rx > 0 && waitMain(rx, deadline);
+    run->ok = txDone && rxDone && sameContents(run->file, received);
+    readStatistics(run, txStats);
+}
+
+static void writeCsvHeader(FILE *csv)
+{
+    fprintf(csv, "file,bytes,arq,baud,ber,prop_us,frame_size,ok,seconds,goodput_Bps,efficiency,"
+                 "theoretical_efficiency,retransmissions,timeouts,frame_error_ratio\n");
+}
+
+static void writeCsvRow(FILE *csv, const Run *run)
+{
+    fprintf(csv, "%s,%ld,%s,%ld,%s,%ld,%d,%d,%.3f,%.1f,%.4f,", run->file, run->fileSize, run->arq, run->baud,
+            run->ber, run->prop, run->frameSize, run->ok, run->seconds, run->goodput, run->efficiency);
+    if (run->theoretical >= 0)
+    {
+        fprintf(csv, "%.4f", run->theoretical);
+    }
+    fprintf(csv, ",%ld,%ld,%.4f\n", run->retransmissions, run->timeouts, run->frameErrorRatio);
+    fflush(csv);
+}
+
+static void usage(const char *program)
+{
+    printf("Usage: %s [options] <file>...\n"
+           "  -b bauds    Baud rates (default: 9600,115200)\n"
+           "  -e bers     Bit error rates, or bursts as ge/<good ber>/<bad ber>/<p good->bad>/<p bad->good>\n"
+           "              (default: 0,1e-5,1e-4)\n"
+           "  -p props    Propagation delays in us (default: 0,20000)\n"
+           "  -f sizes    Largest data packets in bytes (default: 256,1000,4000)\n"
+           "  -a arqs     ARQ schemes, saw, gbn or sr (default: saw)\n"
+           "  -s seed     Seed of the noise, the same for every run (default: 1)\n"
+           "  -m path     Link layer program (default: bin/main)\n"
+           "  -c path     Cable program (default: bin/cable)\n"
+           "  -o path     CSV file (default: bench.csv)\n",
+           program);
+}
+
+int main(int argc, char *argv[])
+{
+    static char bauds[] = "9600,115200";
+    static char bers[] = "0,1e-5,1e-4";
+    static char props[] = "0,20000";
+    static char frameSizes[] = "256,1000,4000";
+    static char arqs[] = "saw";
+
+    Config config = {.mainPath = "bin/main", .cablePath = "bin/cable", .csvPath = "bench.csv", .seed = "1"};
+    parseList(bauds, &config.bauds);
+    parseList(bers, &config.bers);
+    parseList(props, &config.props);
+    parseList(frameSizes, &config.frameSizes);
+    parseList(arqs, &config.arqs);
+
+    int option;
+    int bad = FALSE;
+    while ((option = getopt(argc, argv, "b:e:p:f:a:s:m:c:o:")) != -1)
+    {
+        switch (option)
+        {
+        case 'b': bad |= parseList(optarg, &config.bauds) < 0; break;
+        case 'e': bad |= parseList(optarg, &config.bers) < 0; break;
+        case 'p': bad |= parseList(optarg, &config.props) < 0; break;
+        case 'f': bad |= parseList(optarg, &config.frameSizes) < 0; break;
+        case 'a': bad |= parseList(optarg, &config.arqs) < 0; break;
+        case 's': config.seed = optarg; break;
+        case 'm': config.mainPath = optarg; break;
+        case 'c': config.cablePath = optarg; break;
+        case 'o': config.csvPath = optarg; break;
+        default: bad = TRUE;
+        }
+    }
+    if (bad || optind == argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char workDir[] = "/tmp/bench_link.XXXXXX";
+    if (mkdtemp(workDir) == NULL)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    char cableLog[MAX_PATH];
+    snprintf(cableLog, sizeof(cableLog), "%s/cable.log", workDir);
+
+    FILE *csv = fopen(config.csvPath, "w");
+    if (csv == NULL)
+    {
+        perror(config.csvPath);
+        removeWorkDir(workDir);
+        return 1;
+    }
+    writeCsvHeader(csv);
+
+    // Both ends inherit it, unless already set
+    setenv("LL_CHECK", "crc32", FALSE);
+
+    signal(SIGPIPE, SIG_IGN);
+    if (startCable(config.cablePath, cableLog) < 0)
+    {
+        // The work directory is kept for the cable's log
+        fclose(csv);
+        return 1;
+    }
+
+    printf("%-24s %4s %7s %8s %8s %6s %4s %10s %7s %7s %6s\n", "file", "arq", "baud", "ber", "prop us", "frame",
+           "ok", "goodput", "S", "S theo", "retx");
+
+    int runs = 0;
+    int failures = 0;
+    for (int b = 0; b < config.bauds.count; b++)
+    {
+        long baud = atol(config.bauds.text[b]);
+        cableCommand("baud %ld", baud);
+
+        for (int p = 0; p < config.props.count; p++)
+        {
+            long prop = atol(config.props.text[p]);
+            cableCommand("prop %ld", prop);
+
+            for (int e = 0; e < config.bers.count; e++)
+            {
+                setNoise(config.bers.text[e]);
+
+                for (int f = 0; f < config.frameSizes.count; f++)
+                {
+                    for (int a = 0; a < config.arqs.count; a++)
+                    {
+                        for (int i = optind; i < argc; i++)
+                        {
+                            Run run = {.file = argv[i], .fileSize = fileSize(argv[i]),
+                                       .arq = config.arqs.text[a], .baud = baud, .ber = config.bers.text[e],
+                                       .prop = prop, .frameSize = atoi(config.frameSizes.text[f])};
+                            if (run.fileSize < 0)
+                            {
+                                perror(run.file);
+                                continue;
+                            }
+
+                            cableCommand("seed %s", config.seed);
+                            transfer(&config, &run, workDir);
+                            writeCsvRow(csv, &run);
+                            runs++;
+                            failures += !run.ok;
+
+                            printf("%-24s %4s %7ld %8s %8ld %6d %4s %10.1f %7.4f %7.4f %6ld\n", run.file, run.arq,
+                                   run.baud, run.ber, run.prop, run.frameSize, run.ok ? "yes" : "NO", run.goodput,
+                                   run.efficiency, run.theoretical, run.retransmissions);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    stopCable();
+    removeWorkDir(workDir);
+    fclose(csv);
+    printf("\n%d runs, %d failed, results in %s\n", runs, failures, config.csvPath);
+    return failures > 0 ? 2 : 0;
+}
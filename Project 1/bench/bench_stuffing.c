@@ -0,0 +1,132 @@
+// Byte stuffing microbenchmark: scalar versus SSE2 and AVX2 kernels. The scalar
+// kernel is the byte loop of TP3/write_noncanonical.c, and serves as baseline.
+// Stuffs and destuffs a frame-sized payload of random bytes, text and the
+// worst case of only FLAG bytes, and checks that the round trip is lossless.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "link_layer.h"
+#include "stuffing.h"
+
+#define ITERATIONS 200000
+
+static unsigned int sink;
+
+typedef struct
+{
+    const char *name;
+    StuffingKernel kernel;
+} Kernel;
+
+static const Kernel kernels[] = {
+    {"scalar", StuffingScalar},
+    {"sse2", StuffingSse2},
+    {"avx2", StuffingAvx2},
+};
+
+#define N_KERNELS (int) (sizeof(kernels) / sizeof(kernels[0]))
+
+static void fillRandom(unsigned char *buf, int size)
+{
+    for (int i = 0; i < size; i++)
+    {
+        buf[i] = rand();
+    }
+}
+
+static void fillText(unsigned char *buf, int size)
+{
+    static const char text[] =
+        "The link layer delimits frames with a flag byte and escapes any flag or "
+        "escape byte found in the payload, so text is almost never stuffed.\n";
+    for (int i = 0; i < size; i++)
+    {
+        buf[i] = text[i % (sizeof(text) - 1)];
+    }
+}
+
+static void fillFlags(unsigned char *buf, int size)
+{
+    memset(buf, FLAG, size);
+}
+
+typedef struct
+{
+    const char *name;
+    void (*fill)(unsigned char *, int);
+} Payload;
+
+static const Payload payloads[] = {
+    {"random", fillRandom},
+    {"text", fillText},
+    {"all 0x7E", fillFlags},
+};
+
+#define N_PAYLOADS (int) (sizeof(payloads) / sizeof(payloads[0]))
+
+static double elapsedNs(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+int main(void)
+{
+    static unsigned char payload[MAX_PAYLOAD_SIZE];
+    static unsigned char stuffed[2 * MAX_PAYLOAD_SIZE + 1];
+    static unsigned char destuffed[MAX_PAYLOAD_SIZE];
+    srand(1);
+
+    printf("Byte stuffing of a %d-byte payload, %d iterations (best kernel: %s)\n\n",
+           MAX_PAYLOAD_SIZE, ITERATIONS, kernels[stuffingBestKernel()].name);
+    printf("%-10s %-8s %12s %12s\n", "payload", "kernel", "stuff MB/s", "destuff MB/s");
+
+    for (int p = 0; p < N_PAYLOADS; p++)
+    {
+        payloads[p].fill(payload, MAX_PAYLOAD_SIZE);
+
+        for (int k = 0; k < N_KERNELS; k++)
+        {
+            if (stuffingSelectKernel(kernels[k].kernel) < 0)
+            {
+                printf("%-10s %-8s %12s %12s\n", payloads[p].name, kernels[k].name, "n/a", "n/a");
+                continue;
+            }
+
+            struct timespec start, end;
+            size_t stuffedSize = 0;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int i = 0; i < ITERATIONS; i++)
+            {
+                stuffedSize = stuffBytes(payload, MAX_PAYLOAD_SIZE, stuffed);
+                sink += stuffed[i % stuffedSize];
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double stuffNs = elapsedNs(&start, &end) / ITERATIONS;
+            stuffed[stuffedSize] = FLAG;
+
+            size_t written = 0;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int i = 0; i < ITERATIONS; i++)
+            {
+                int escaped = 0;
+                sink += destuffBytes(stuffed, stuffedSize + 1, destuffed, sizeof(destuffed), &written, &escaped);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double destuffNs = elapsedNs(&start, &end) / ITERATIONS;
+
+            if (written != MAX_PAYLOAD_SIZE || memcmp(payload, destuffed, MAX_PAYLOAD_SIZE) != 0)
+            {
+                printf("%s kernel: round trip mismatch\n", kernels[k].name);
+                return 1;
+            }
+
+            printf("%-10s %-8s %12.1f %12.1f\n", payloads[p].name, kernels[k].name,
+                   MAX_PAYLOAD_SIZE / stuffNs * 1e3, MAX_PAYLOAD_SIZE / destuffNs * 1e3);
+        }
+    }
+
+    return sink == 0xFFFFFFFF;
+}
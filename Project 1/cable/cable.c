@@ -5,12 +5,16 @@
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
 // Modified by: Rui Prior [rcprior@fc.up.pt]
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <unistd.h>
 #include <time.h>
@@ -29,30 +33,119 @@
 
 #define BUF_SIZE 2048
 
+// Bytes read from a port ahead of the line, waiting for their turn to be
+// sent: like the buffers of a real port, they let writes return before the
+// bytes are on the line, without taking a whole file at once
+#define BACKLOG_SIZE 4096
+
+// After the program on a port closes it, how often to check for the next one
+#define HANGUP_RETRY_NS 100000000LL
+
+#define MAX_EVENTS 8
+
+// A scenario without "quit" ends once data went through the cable after its
+// last event and the line was then idle this long, longer than the link
+// layer waits before it retransmits
+#define SCENARIO_IDLE_NS 5000000000LL
+
+// Bytes are released at most once per tick, all those due in one write, so
+// that high baud rates do not take a wakeup per byte; each byte still keeps
+// its own due time, so the average rate is exact
+#define TICK_NS 250000LL
+
+// Seed of the noise generators until "seed" changes it, so that runs repeat
+#define DEFAULT_SEED 1
+
+// A gap between random events that never ends
+#define NEVER 0x7FFFFFFFFFFFFFFFLL
+
+// Noise on one direction of the line. Each bit is wrong independently with
+// the BER of the current state; with the Gilbert-Elliott model the line moves
+// between a good and a bad state, checked once per byte, so the errors come in
+// bursts while the bad state lasts.
+struct noise {
+    int gilbert;         // TRUE for Gilbert-Elliott, FALSE for a single state
+    int bad;             // Current state, always FALSE with a single state
+    double ber[2];       // Bit error rate in the good and in the bad state
+    double byteER[2];    // Probability that a byte has some wrong bit
+    double toBad;        // Probability per byte of going from good to bad
+    double toGood;       // and from bad to good
+    long long stay;      // Bytes left before the state changes
+    long long clean;     // Bytes left before the next one with wrong bits
+};
+
+// Bytes on their way in one direction, oldest first. Each byte is stamped
+// when read with the time it reaches the other end: after the bytes before it
+// and its own byte time on the line, plus the propagation delay.
+struct direction {
+    const char *name;
+    int inFd;          // Port the bytes come from
+    int outFd;         // Port they are released to
+    char *data;
+    long long *due;    // CLOCK_MONOTONIC ns
+    char *burst;       // TRUE for a byte that found the line idle
+    struct noise noise;
+    unsigned long long random[4];  // Generator of the noise, one per direction
+    long capacity;
+    long head;
+    long count;
+    long long lineFree;  // When the line is free for the next byte, in ps
+    int watched;       // TRUE while inFd is in the epoll set
+    long long resumeAt;  // When to watch inFd again, if not watched
+
+    // Achieved rate: bytes released in the middle of bursts, and the time
+    // they took since the batch before them
+    long long lastRelease;  // Previous batch of the current burst, 0 if none
+    long long measuredBytes;
+    long long measuredNs;
+
+    // Totals for the summary
+    long long carried;
+    long long corrupted;
+    long long bitErrors;
+    long long badBytes;  // Released in the bad state
+    long long dropped;   // Read or due while the cable was off
+};
+
+// A command of a scenario and when it runs, in ns since the cable is ready
+struct event {
+    long long at;
+    int index; // Position in the scenario as given, to keep ties in order
+    char *command;
+};
+
+// Scenario given on the command line: its events in time order
+struct scenario {
+    struct event *events;
+    int count;
+    int next;           // First event still to run
+    long long start;    // CLOCK_MONOTONIC ns when the cable was ready
+    long long lastActivity;  // Last time bytes were read or released
+};
+
+struct scenario scn = { .events = NULL, .count = 0, .next = 0 };
+
 // Current running parameters
 struct parameters {
     int cableOn;
-    double byteER;   // Byte error rate
-    struct timespec byteDelay;
+    unsigned long long seed;
+    unsigned long baud;
+    long long byteTime;   // Picoseconds per byte on the line
     unsigned long propDelay;   // Desired propagation delay in usec
-    int bufSize;  // Dimensioned to enforce the propagation delay
-    char *tx2rx;  
-    char *tx2rxValid;  // TRUE if corresponding entry holds a byte
-    long tx2rxIdx;     // Input index for the tx2rx buffer
-    char *rx2tx;
-    char *rx2txValid;  // TRUE if corresponding entry holds a byte
-    long rx2txIdx;     // Input index for the tx2rx buffer
+    struct direction tx2rx;
+    struct direction rx2tx;
+    int epollFd;
+    int timerFd;
     FILE *logfile;
 };
 
 struct parameters par = {
     .cableOn = TRUE,
-    .byteER = 0.0,
     .propDelay = 0,
-    .tx2rx = NULL,
-    .tx2rxValid = NULL,
-    .rx2tx = NULL,
-    .rx2txValid = NULL,
+    .tx2rx = { .name = "Tx->Rx", .data = NULL, .due = NULL, .burst = NULL,
+               .noise = { .stay = NEVER, .clean = NEVER } },
+    .rx2tx = { .name = "Rx->Tx", .data = NULL, .due = NULL, .burst = NULL,
+               .noise = { .stay = NEVER, .clean = NEVER } },
     .logfile = NULL
 };
 
@@ -86,50 +179,72 @@ int openSerialPort(const char *serialPort, struct termios *oldtio, struct termio
 }
 
 
-// Add noise to a buffer, by flipping the byte in the "errorIndex" position.
-void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
+long long now_ns(void)
 {
-    buf[errorIndex] ^= 0xFF;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
 }
 
 
-// Initialize the ring buffers that implement the propagation delay
+// Size the queues for the bytes the propagation delay keeps on the line plus
+// the backlog, dropping the bytes in flight
 // Returns 0 on success, -1 on failure
 int init_ring_buffers(void)
 {
-    long nsecPropDelay = 1000 * par.propDelay;
-    long bytesInFlight = nsecPropDelay / par.byteDelay.tv_nsec;
-    // Round instead of truncating
-    if (nsecPropDelay % par.byteDelay.tv_nsec > par.byteDelay.tv_nsec / 2)
+    long bytesInFlight = 1000000LL * par.propDelay / par.byteTime + 1;
+    struct direction *dirs[] = { &par.tx2rx, &par.rx2tx };
+    for (int i = 0; i < 2; i++)
     {
-        ++bytesInFlight;
+        struct direction *dir = dirs[i];
+        dir->capacity = bytesInFlight + BACKLOG_SIZE + 1;
+        dir->data = realloc(dir->data, dir->capacity);
+        dir->due = realloc(dir->due, dir->capacity * sizeof(long long));
+        dir->burst = realloc(dir->burst, dir->capacity);
+        if (dir->data == NULL || dir->due == NULL || dir->burst == NULL)
+        {
+            return -1;
+        }
+        dir->head = 0;
+        dir->count = 0;
+        dir->lineFree = 0;
+        dir->lastRelease = 0;
+        dir->measuredBytes = 0;
+        dir->measuredNs = 0;
     }
-    long actualPropDelay = bytesInFlight * par.byteDelay.tv_nsec / 1000; // usec
-    par.bufSize = bytesInFlight + 1;
-    par.tx2rx = realloc(par.tx2rx, par.bufSize);  
-    par.tx2rxValid = realloc(par.tx2rxValid, par.bufSize);
-    par.rx2tx = realloc(par.rx2tx, par.bufSize);
-    par.rx2txValid = realloc(par.rx2txValid, par.bufSize);
-    if (par.tx2rx == NULL || par.tx2rxValid == NULL || par.rx2tx == NULL || par.rx2txValid == NULL)
+    printf("PROPAGATION DELAY SET TO %lu usec\n", par.propDelay);
+    return 0;
+}
+
+
+// Print the rate each direction achieved since the baud rate was set
+void report_rate(void)
+{
+    struct direction *dirs[] = { &par.tx2rx, &par.rx2tx };
+    for (int i = 0; i < 2; i++)
     {
-        return -1;
+        struct direction *dir = dirs[i];
+        if (dir->measuredNs > 0)
+        {
+            double achieved = dir->measuredBytes * 10 * 1.0e9 / dir->measuredNs;
+            printf("%s: ACHIEVED %.0f BAUD, REQUESTED %lu (%+.2f%%) OVER %lld BYTES\n", dir->name, achieved,
+                   par.baud, (achieved / par.baud - 1) * 100, dir->measuredBytes);
+        }
+        else
+        {
+            printf("%s: NO RATE MEASURED YET\n", dir->name);
+        }
     }
-    bzero(par.tx2rxValid, par.bufSize);
-    bzero(par.rx2txValid, par.bufSize);
-    par.tx2rxIdx = 0;
-    par.rx2txIdx = 0;
-    printf("PROPAGATION DELAY SET TO %ld usec (DESIRED = %lu usec)\n", actualPropDelay, par.propDelay);
-    return 0;
 }
 
 
-// Set the byte delay corresponding to the selected baud rate
+// Set the byte time corresponding to the selected baud rate
 void set_baud_rate(unsigned long baud)
 {
-    // 10 bit times per byte; delay in nanoseconds
-    double delay = 1.0e10 / baud;
-    par.byteDelay.tv_sec = 0;
-    par.byteDelay.tv_nsec = (long) delay;
+    // 10 bit times per byte; in picoseconds, so that rates like 921600 keep
+    // their exact average
+    par.baud = baud;
+    par.byteTime = (long long) (1.0e13 / baud);
     printf("BAUD RATE: %lu\n", baud);
     init_ring_buffers();
 }
@@ -144,62 +259,6 @@ void set_rt_priority(void) {
 }
 
 
-// Compute the difference between two timespecs
-struct timespec timespec_diff(const struct timespec *t2, const struct timespec *t1)
-{
-    struct timespec diff = { .tv_sec = t2->tv_sec - t1->tv_sec,
-                             .tv_nsec = t2->tv_nsec - t1->tv_nsec };
-    if (diff.tv_nsec < 0) {
-        diff.tv_nsec += 1000000000;
-        --diff.tv_sec;
-    }
-    return diff;
-}
-
-
-// Compute the sum of two timespecs
-struct timespec timespec_sum(const struct timespec *t1, const struct timespec *t2)
-{
-    struct timespec sum = { .tv_sec = t1->tv_sec + t2->tv_sec,
-                             .tv_nsec = t1->tv_nsec + t2->tv_nsec };
-    if (sum.tv_nsec >= 1000000000) {
-        sum.tv_nsec -= 1000000000;
-        ++sum.tv_sec;
-    }
-    return sum;
-}
-
-
-// Compare two timespecs returning -1, 0 or 1 if t1 is less than, equal or
-// greater than t2, respectively
-int timespec_comp(const struct timespec *t1, const struct timespec *t2)
-{
-    if (t1->tv_sec < t2->tv_sec) {
-        return -1;
-    }
-    else if (t1->tv_sec > t2->tv_sec) {
-        return 1;
-    }
-    else if (t1->tv_nsec < t2->tv_nsec) {
-        return -1;
-    }
-    else if (t1->tv_nsec > t2->tv_nsec) {
-        return 1;
-    }
-    return 0;
-}
-
-
-int timespec_is_negative(const struct timespec *t)
-{
-    if (t->tv_sec < 0 || t->tv_nsec < 0)
-    {
-        return TRUE;
-    }
-    return FALSE;
-}
-
-
 void endlog(void)
 {
     if (par.logfile != NULL)
@@ -226,6 +285,23 @@ void startlog(const char *filename)
 }
 
 
+// Log "count" bytes in one of the four columns: taken from Tx, given to Rx,
+// taken from Rx, given to Tx
+void log_bytes(int column, const char *bytes, long count)
+{
+    if (par.logfile == NULL)
+    {
+        return;
+    }
+    for (long i = 0; i < count; i++)
+    {
+        char cells[4][3] = { "  ", "  ", "  ", "  " };
+        sprintf(cells[column], "%02hhX", bytes[i]);
+        fprintf(par.logfile, "%s  %s | %s  %s\n", cells[0], cells[1], cells[2], cells[3]);
+    }
+}
+
+
 // Show help
 void help()
 {
@@ -238,21 +314,827 @@ void help()
            "--- on           : connect the cable and data is exchanged (default state)\n"
            "--- off          : disconnect the cable disabling data to be exchanged\n"
            "--- ber <ber>    : add noise to data bits at a specified BER (default=0)\n"
-           "--- baud <rate>  : set baud rate, between 1200 and 115200 (default=9600)\n"
+           "--- ge <good ber> <bad ber> <p good->bad> <p bad->good>\n"
+           "                 : add bursts of noise (Gilbert-Elliott): each state has its\n"
+           "                   BER, and the state changes with these probabilities per byte\n"
+           "--- baud <rate>  : set baud rate, between 1200 and 4000000 (default=9600)\n"
            "                   note that 10 bits are sent per byte (8-N-1)\n"
+           "--- rate         : show the baud rate achieved since it was set\n"
+           "--- seed [<n>]   : restart the noise from seed n (default=1), or show the seed\n"
            "--- prop <delay> : set the propagation delay in usec (0-1000000, default=0)\n"
-           "                   will be approximated to an integer multiple of the byte\n"
-           "                   delay (10 / baud_rate)\n"
            "--- log <file>   : log transmitted data to file\n"
            "--- endlog       : stop logging transmitted data\n"
-           "--- quit         : terminate the program\n\n"
+           "--- quit         : terminate the program\n"
+           "\"tx\" or \"rx\" before ber or ge sets the noise of the bytes sent by the\n"
+           "transmitter or by the receiver only, e.g. \"tx ge 0 0.01 0.001 0.05\"\n\n"
            "IMPORTANT: Changing de baud rate or propagation delay while a transmission is\n"
            "           ongoing will result in losses.\n"
            "\n");
 }
 
+
+// Add or remove the input port of "dir" from the epoll set
+void watch_input(struct direction *dir, int watch)
+{
+    if (watch == dir->watched)
+    {
+        return;
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = dir->inFd };
+    epoll_ctl(par.epollFd, watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, dir->inFd, &event);
+    dir->watched = watch;
+    dir->resumeAt = 0;
+}
+
+
+// Read what the input port has, up to the backlog, and queue it
+void take_input(struct direction *dir, long long now, int logColumn)
+{
+    char buf[BACKLOG_SIZE];
+    long long nowPs = now * 1000;
+    long backlog = dir->lineFree > nowPs ? (dir->lineFree - nowPs) / par.byteTime : 0;
+    long room = BACKLOG_SIZE - backlog;
+    if (room > dir->capacity - dir->count)
+    {
+        room = dir->capacity - dir->count;
+    }
+    if (room <= 0)
+    {
+        // Wait for half of the backlog to go out before reading again
+        watch_input(dir, FALSE);
+        dir->resumeAt = now + BACKLOG_SIZE / 2 * par.byteTime / 1000;
+        return;
+    }
+
+    ssize_t size = read(dir->inFd, buf, room);
+    if (size < 0 && (errno == EAGAIN || errno == EINTR))
+    {
+        return;
+    }
+    if (size <= 0)
+    {
+        // Nobody has the port open: check again later instead of spinning on the hangup
+        watch_input(dir, FALSE);
+        dir->resumeAt = now + HANGUP_RETRY_NS;
+        return;
+    }
+
+    scn.lastActivity = now;
+    if (!par.cableOn)
+    {
+        // Ignore what was read
+        dir->dropped += size;
+        return;
+    }
+    log_bytes(logColumn, buf, size);
+
+    for (ssize_t i = 0; i < size; i++)
+    {
+        long tail = (dir->head + dir->count) % dir->capacity;
+        dir->burst[tail] = dir->lineFree < nowPs;
+        long long start = dir->burst[tail] ? nowPs : dir->lineFree;
+        dir->lineFree = start + par.byteTime;
+        dir->data[tail] = buf[i];
+        dir->due[tail] = dir->lineFree / 1000 + 1000LL * par.propDelay;
+        dir->count++;
+    }
+}
+
+
+// Add the "count" bytes released at "now" from "first" on to the achieved
+// rate. Only batches in the middle of a burst count: the first one just
+// starts the clock, and the last one holds fewer bytes than its tick carried.
+void measure_release(struct direction *dir, long first, long count, long long now)
+{
+    int started = FALSE;
+    for (long i = 0; i < count; i++)
+    {
+        started |= dir->burst[(first + i) % dir->capacity];
+    }
+    int continues = dir->count > count && !dir->burst[(first + count) % dir->capacity];
+
+    if (!started && continues && dir->lastRelease > 0)
+    {
+        dir->measuredBytes += count;
+        dir->measuredNs += now - dir->lastRelease;
+    }
+    dir->lastRelease = continues ? now : 0;
+}
+
+
+// Next number of a xoshiro256** generator with state "rng"
+unsigned long long random_next(unsigned long long *rng)
+{
+    unsigned long long x = rng[1] * 5;
+    unsigned long long result = (x << 7 | x >> 57) * 9;
+    unsigned long long t = rng[1] << 17;
+    rng[2] ^= rng[0];
+    rng[3] ^= rng[1];
+    rng[1] ^= rng[2];
+    rng[0] ^= rng[3];
+    rng[2] ^= t;
+    rng[3] = rng[3] << 45 | rng[3] >> 19;
+    return result;
+}
+
+
+// Uniform random number in [0, 1)
+double random_unit(unsigned long long *rng)
+{
+    return (random_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+// Fill the state of a generator from "seed" with splitmix64, as the authors
+// of xoshiro recommend
+void random_seed(unsigned long long *rng, unsigned long long seed)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        unsigned long long z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ z >> 30) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ z >> 27) * 0x94D049BB133111EBULL;
+        rng[i] = z ^ z >> 31;
+    }
+}
+
+
+// Natural logarithm of x > 0, without libm: x = m * 2^e with m between
+// sqrt(1/2) and sqrt(2), and ln(m) = 2 atanh((m - 1) / (m + 1)) by its series
+double natural_log(double x)
+{
+    unsigned long long bits;
+    memcpy(&bits, &x, sizeof(bits));
+    int exponent = (int) (bits >> 52 & 0x7FF) - 1023;
+    bits = (bits & 0x000FFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL;
+    double m;
+    memcpy(&m, &bits, sizeof(m));
+    if (m > 1.4142135623730951)
+    {
+        m /= 2;
+        exponent++;
+    }
+
+    double t = (m - 1) / (m + 1);
+    double power = t;
+    double sum = 0;
+    for (int k = 1; power > 1e-18 || power < -1e-18; k += 2)
+    {
+        sum += power / k;
+        power *= t * t;
+    }
+    return 2 * sum + exponent * 0.69314718055994531;
+}
+
+
+// Number of failures before the first success of trials that succeed with
+// probability "p", with a single random number
+long long geometric(unsigned long long *rng, double p)
+{
+    if (p <= 0.0)
+    {
+        return NEVER;
+    }
+    if (p >= 1.0)
+    {
+        return 0;
+    }
+    double gap = natural_log(1.0 - random_unit(rng)) / natural_log(1.0 - p);
+    return gap < NEVER ? (long long) gap : NEVER;
+}
+
+
+// Probability that a byte has at least one wrong bit, for a bit error rate "ber"
+double byte_error_rate(double ber)
+{
+    // Compute pow(1 - ber, 8) without libm
+    double clean = 1;
+    for (int bit = 0; bit < 8; bit++)
+    {
+        clean *= 1 - ber;
+    }
+    return 1.0 - clean;
+}
+
+
+// Draw the bytes to the next state change and to the next wrong byte, in the
+// state "noise" is in
+void draw_gaps(struct noise *noise, unsigned long long *rng)
+{
+    noise->stay = noise->gilbert ? geometric(rng, noise->bad ? noise->toGood : noise->toBad) : NEVER;
+    noise->clean = geometric(rng, noise->byteER[noise->bad]);
+}
+
+
+// Move "noise" to its state for the next byte, and flip each bit of "byte"
+// with the BER of that state. Random numbers are drawn only for state changes
+// and wrong bits: the gaps between them are geometric.
+// Returns the number of bits flipped
+int add_noise(struct noise *noise, unsigned long long *rng, char *byte)
+{
+    if (noise->stay-- == 0)
+    {
+        noise->bad = !noise->bad;
+        draw_gaps(noise, rng);
+    }
+    if (noise->clean > 0)
+    {
+        noise->clean--;
+        return 0;
+    }
+    noise->clean = geometric(rng, noise->byteER[noise->bad]);
+
+    // The byte has some wrong bit. The first is drawn from the geometric
+    // distribution truncated to the 8 bits; the others follow it with
+    // geometric gaps, so the pattern is exact for any BER
+    double ber = noise->ber[noise->bad];
+    if (ber >= 1.0)
+    {
+        *byte ^= (char) 0xFF;
+        return 8;
+    }
+    double logClean = natural_log(1 - ber);
+    double u = random_unit(rng);
+    int bit = (int) (natural_log(1 - u * noise->byteER[noise->bad]) / logClean);
+    int mask = 0;
+    int wrongBits = 0;
+    while (bit < 8)
+    {
+        mask |= 1 << bit;
+        wrongBits++;
+        bit += 1 + geometric(rng, ber);
+    }
+    *byte ^= (char) mask;
+    return wrongBits;
+}
+
+
+// Restart the noise generators from "seed", each direction with its own, so
+// that the errors of one do not depend on the traffic of the other
+void set_seed(unsigned long long seed)
+{
+    par.seed = seed;
+    random_seed(par.tx2rx.random, 2 * seed);
+    random_seed(par.rx2tx.random, 2 * seed + 1);
+    draw_gaps(&par.tx2rx.noise, par.tx2rx.random);
+    draw_gaps(&par.rx2tx.noise, par.rx2tx.random);
+    printf("RANDOM SEED %llu\n", seed);
+}
+
+
+// Set the noise of the directions in "dirs" from "command", "ber ..." or "ge ..."
+// Returns FALSE if "command" is not about noise
+int set_noise(const char *command, struct direction **dirs, int count)
+{
+    struct noise noise = { .gilbert = FALSE, .bad = FALSE };
+    if (strncmp(command, "ber ", 4) == 0)
+    {
+        if (sscanf(command + 4, "%lf", &noise.ber[0]) < 1 || noise.ber[0] < 0.0 || noise.ber[0] > 1.0)
+        {
+            printf("BAD BER VALUE (MUST BE 0 <= BER <= 1)\n");
+            return TRUE;
+        }
+    }
+    else if (strncmp(command, "ge ", 3) == 0)
+    {
+        noise.gilbert = TRUE;
+        if (sscanf(command + 3, "%lf %lf %lf %lf", &noise.ber[0], &noise.ber[1], &noise.toBad, &noise.toGood) < 4 ||
+            noise.ber[0] < 0.0 || noise.ber[0] > 1.0 || noise.ber[1] < 0.0 || noise.ber[1] > 1.0 ||
+            noise.toBad < 0.0 || noise.toBad > 1.0 || noise.toGood < 0.0 || noise.toGood > 1.0)
+        {
+            printf("BAD GILBERT-ELLIOTT MODEL (MUST BE ge <good ber> <bad ber> <p good->bad> <p bad->good>,\n"
+                   "                          ALL BETWEEN 0 AND 1)\n");
+            return TRUE;
+        }
+    }
+    else
+    {
+        return FALSE;
+    }
+    noise.byteER[0] = byte_error_rate(noise.ber[0]);
+    noise.byteER[1] = byte_error_rate(noise.ber[1]);
+
+    for (int i = 0; i < count; i++)
+    {
+        dirs[i]->noise = noise;
+        draw_gaps(&dirs[i]->noise, dirs[i]->random);
+    }
+    const char *name = count == 1 ? dirs[0]->name : "BOTH WAYS";
+    if (!noise.gilbert)
+    {
+        printf("%s: BER SET TO %g\n", name, noise.ber[0]);
+        return TRUE;
+    }
+
+    // Long-run share of bytes in the bad state, and how long it lasts
+    double change = noise.toBad + noise.toGood;
+    double badShare = change > 0 ? noise.toBad / change : 0;
+    printf("%s: GILBERT-ELLIOTT BER %g GOOD, %g BAD, P(GOOD->BAD) %g, P(BAD->GOOD) %g PER BYTE\n", name,
+           noise.ber[0], noise.ber[1], noise.toBad, noise.toGood);
+    printf("   AVERAGE BER %g, %.2f%% OF THE BYTES IN THE BAD STATE", (1 - badShare) * noise.ber[0] +
+           badShare * noise.ber[1], 100 * badShare);
+    if (noise.toGood > 0)
+    {
+        printf(", %.1f BYTES PER BURST ON AVERAGE", 1 / noise.toGood);
+    }
+    printf("\n");
+    return TRUE;
+}
+
+
+// Write all the bytes that are due with a single writev()
+// Returns the lateness of the last byte released, in ns
+long long release_due(struct direction *dir, long long now, int logColumn)
+{
+    long count = 0;
+    while (count < dir->count && dir->due[(dir->head + count) % dir->capacity] <= now)
+    {
+        // Bytes lost while the cable is off draw no noise, so that a seed
+        // gives the same errors whatever the outages
+        if (par.cableOn)
+        {
+            char *byte = dir->data + (dir->head + count) % dir->capacity;
+            int wrongBits = add_noise(&dir->noise, dir->random, byte);
+            dir->badBytes += dir->noise.bad;
+            dir->bitErrors += wrongBits;
+            dir->corrupted += wrongBits > 0;
+        }
+        count++;
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    // The bytes wrap around the end of the ring at most once
+    struct iovec iov[2];
+    long first = dir->capacity - dir->head < count ? dir->capacity - dir->head : count;
+    iov[0].iov_base = dir->data + dir->head;
+    iov[0].iov_len = first;
+    iov[1].iov_base = dir->data;
+    iov[1].iov_len = count - first;
+
+    // Bytes due while the cable is off are lost
+    if (par.cableOn)
+    {
+        writev(dir->outFd, iov, count > first ? 2 : 1);
+        log_bytes(logColumn, iov[0].iov_base, iov[0].iov_len);
+        log_bytes(logColumn, iov[1].iov_base, iov[1].iov_len);
+        measure_release(dir, dir->head, count, now);
+        dir->carried += count;
+    }
+    else
+    {
+        dir->lastRelease = 0;
+        dir->dropped += count;
+    }
+    scn.lastActivity = now;
+
+    long long lateness = now - dir->due[(dir->head + count - 1) % dir->capacity];
+    dir->head = (dir->head + count) % dir->capacity;
+    dir->count -= count;
+    return lateness;
+}
+
+
+// Arm the timer for the next byte due or port to watch again, but not before
+// the next tick after "lastWake", or disarm it if nothing is pending, so that
+// an idle cable sleeps
+void schedule_timer(long long lastWake)
+{
+    long long next = 0;
+    struct direction *dirs[] = { &par.tx2rx, &par.rx2tx };
+    for (int i = 0; i < 2; i++)
+    {
+        struct direction *dir = dirs[i];
+        if (dir->count > 0 && (next == 0 || dir->due[dir->head] < next))
+        {
+            next = dir->due[dir->head];
+        }
+        if (!dir->watched && (next == 0 || dir->resumeAt < next))
+        {
+            next = dir->resumeAt;
+        }
+    }
+
+    if (next > 0 && next < lastWake + TICK_NS)
+    {
+        next = lastWake + TICK_NS;
+    }
+
+    // Scenario events keep their own time, and so does the check for its end
+    long long scenarioAt = 0;
+    if (scn.next < scn.count)
+    {
+        scenarioAt = scn.start + scn.events[scn.next].at;
+    }
+    else if (scn.count > 0)
+    {
+        scenarioAt = scn.lastActivity + SCENARIO_IDLE_NS;
+    }
+    if (scenarioAt > 0 && (next == 0 || scenarioAt < next))
+    {
+        next = scenarioAt;
+    }
+
+    // A zero it_value disarms the timer; times already past fire at once
+    struct itimerspec spec = { .it_interval = { 0, 0 } };
+    if (next > 0)
+    {
+        spec.it_value.tv_sec = next / 1000000000LL;
+        spec.it_value.tv_nsec = next % 1000000000LL;
+    }
+    timerfd_settime(par.timerFd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+
+// Run one command
+// Returns TRUE if the program must stop
+int run_command(const char *command)
+{
+    if (strcmp(command, "off") == 0)
+    {
+        printf("CONNECTION OFF\n");
+        if (par.cableOn && par.logfile != NULL)
+        {
+            fputs("CABLE OFF\n", par.logfile);
+        }
+        par.cableOn = FALSE;
+    }
+    else if (strcmp(command, "on") == 0)
+    {
+        printf("CONNECTION ON\n");
+        par.cableOn = TRUE;
+    }
+    else if (strncmp(command, "tx ", 3) == 0 || strncmp(command, "rx ", 3) == 0)
+    {
+        struct direction *dir = command[0] == 't' ? &par.tx2rx : &par.rx2tx;
+        if (!set_noise(command + 3, &dir, 1))
+        {
+            printf("BAD COMMAND OR MISSING PARAMETERS\n");
+        }
+    }
+    else if (strncmp(command, "ber ", 4) == 0 || strncmp(command, "ge ", 3) == 0)
+    {
+        struct direction *dirs[] = { &par.tx2rx, &par.rx2tx };
+        set_noise(command, dirs, 2);
+    }
+    else if (strcmp(command, "seed") == 0)
+    {
+        printf("RANDOM SEED %llu\n", par.seed);
+    }
+    else if (strncmp(command, "seed ", 5) == 0)
+    {
+        unsigned long long seed;
+        if (sscanf(command + 5, "%llu", &seed) < 1)
+        {
+            printf("BAD SEED (MUST BE AN INTEGER FROM 0 TO 18446744073709551615)\n");
+        }
+        else
+        {
+            set_seed(seed);
+        }
+    }
+    else if (strncmp(command, "baud ", 5) == 0)
+    {
+        unsigned long baud = 0;
+        sscanf(command + 5, "%lu", &baud);
+        switch (baud) {
+            case 1200:
+            case 1800:
+            case 2400:
+            case 4800:
+            case 9600:
+            case 19200:
+            case 38400:
+            case 57600:
+            case 115200:
+            case 230400:
+            case 460800:
+            case 500000:
+            case 576000:
+            case 921600:
+            case 1000000:
+            case 1152000:
+            case 1500000:
+            case 2000000:
+            case 2500000:
+            case 3000000:
+            case 3500000:
+            case 4000000:
+                if (par.tx2rx.measuredNs > 0 || par.rx2tx.measuredNs > 0)
+                {
+                    report_rate();
+                }
+                set_baud_rate(baud);
+                break;
+            default:
+                printf("UNSUPPORTED BAUD RATE: must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600, 115200,\n"
+                       "                       230400, 460800, 500000, 576000, 921600, 1000000, 1152000, 1500000,\n"
+                       "                       2000000, 2500000, 3000000, 3500000 or 4000000\n");
+        }
+    }
+    else if (strncmp(command, "prop ", 5) == 0)
+    {
+        unsigned long propDelay;
+        if (sscanf(command + 5, "%lu", &propDelay) < 1 || propDelay > 1000000)
+        {
+            printf("BAD OR OUT OF RANGE PROPAGATION DELAY\n");
+        }
+        else
+        {
+            par.propDelay = propDelay;
+            init_ring_buffers();
+        }
+    }
+    else if (strncmp(command, "log ", 4) == 0)
+    {
+        startlog(command + 4);
+    }
+    else if (strcmp(command, "endlog") == 0)
+    {
+        endlog();
+        printf("NOT LOGGING\n");
+    }
+    else if (strcmp(command, "rate") == 0)
+    {
+        report_rate();
+    }
+    else if (strcmp(command, "quit") == 0)
+    {
+        printf("END OF THE PROGRAM\n");
+        return TRUE;
+    }
+    else if (strcmp(command, "help") == 0) {
+        help();
+    }
+    else {
+        printf("BAD COMMAND OR MISSING PARAMETERS\n");
+    }
+    return FALSE;
+}
+
+
+// Run the complete lines read from STDIN; several may come in one read
+// Returns TRUE if the program must stop
+int read_commands(void)
+{
+    static char pending[BUF_SIZE];
+    static int pendingSize = 0;
+
+    int size = read(STDIN_FILENO, pending + pendingSize, BUF_SIZE - 1 - pendingSize);
+    if (size <= 0)
+    {
+        if (size == 0)
+        {
+            // No more commands, keep running until killed
+            epoll_ctl(par.epollFd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+        }
+        return FALSE;
+    }
+    pendingSize += size;
+    pending[pendingSize] = '\0';
+
+    char *line = pending;
+    char *newline;
+    int stop = FALSE;
+    while (!stop && (newline = strchr(line, '\n')) != NULL)
+    {
+        *newline = '\0';
+        stop = run_command(line);
+        line = newline + 1;
+    }
+    pendingSize -= line - pending;
+    memmove(pending, line, pendingSize);
+
+    // A line too long for the buffer is dropped
+    if (pendingSize == BUF_SIZE - 1)
+    {
+        printf("BAD COMMAND OR MISSING PARAMETERS\n");
+        pendingSize = 0;
+    }
+    return stop;
+}
+
+
+// Parse a time like "2s", "5.5s", "500ms", "250us" or "0" (seconds)
+// Returns the time in ns, or -1 if it is malformed
+long long parse_time(const char *text)
+{
+    char *unit;
+    double value = strtod(text, &unit);
+    if (unit == text || value < 0)
+    {
+        return -1;
+    }
+    if (*unit == '\0' || strcmp(unit, "s") == 0)
+    {
+        return (long long) (value * 1.0e9 + 0.5);
+    }
+    if (strcmp(unit, "ms") == 0)
+    {
+        return (long long) (value * 1.0e6 + 0.5);
+    }
+    if (strcmp(unit, "us") == 0)
+    {
+        return (long long) (value * 1.0e3 + 0.5);
+    }
+    return -1;
+}
+
+
+int compare_events(const void *a, const void *b)
+{
+    const struct event *x = a;
+    const struct event *y = b;
+    if (x->at != y->at)
+    {
+        return x->at < y->at ? -1 : 1;
+    }
+    // Events at the same time keep their order: qsort() is not stable
+    return x->index < y->index ? -1 : 1;
+}
+
+
+// Add the events of "text": "t=<time> <command>" separated by ";" or new
+// lines, "#" starting a comment up to the end of the line
+// Returns 0 on success, -1 on a malformed event
+int parse_scenario(char *text)
+{
+    for (char *line = text; *line != '\0'; )
+    {
+        char *end = line + strcspn(line, ";\n");
+        char *comment = memchr(line, '#', end - line);
+        char separator = *end;
+        *(comment != NULL ? comment : end) = '\0';
+
+        // Trim spaces around the event
+        while (*line == ' ' || *line == '\t' || *line == '\r')
+        {
+            line++;
+        }
+        char *last = line + strlen(line);
+        while (last > line && (last[-1] == ' ' || last[-1] == '\t' || last[-1] == '\r'))
+        {
+            *--last = '\0';
+        }
+
+        if (*line != '\0')
+        {
+            char *space = strchr(line, ' ');
+            long long at = -1;
+            if (strncmp(line, "t=", 2) == 0 && space != NULL)
+            {
+                *space = '\0';
+                at = parse_time(line + 2);
+            }
+            if (at < 0)
+            {
+                if (space != NULL)
+                {
+                    *space = ' ';
+                }
+                printf("BAD SCENARIO EVENT \"%s\" (MUST BE t=<time>[s|ms|us] <command>)\n", line);
+                return -1;
+            }
+            space += strspn(space + 1, " ") + 1;
+
+            scn.events = realloc(scn.events, (scn.count + 1) * sizeof(struct event));
+            if (scn.events == NULL)
+            {
+                return -1;
+            }
+            scn.events[scn.count].at = at;
+            scn.events[scn.count].index = scn.count;
+            scn.events[scn.count].command = strdup(space);
+            scn.count++;
+        }
+
+        line = separator == '\0' ? end : end + 1;
+    }
+    return 0;
+}
+
+
+// Read the scenario file "path"
+// Returns 0 on success, -1 on error
+int load_scenario(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    char *text = NULL;
+    size_t size = 0;
+    char chunk[BUF_SIZE];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    {
+        text = realloc(text, size + read + 1);
+        memcpy(text + size, chunk, read);
+        size += read;
+    }
+    fclose(file);
+    if (text == NULL)
+    {
+        return 0;
+    }
+    text[size] = '\0';
+    int res = parse_scenario(text);
+    free(text);
+    return res;
+}
+
+
+// Run the scenario events that are due
+// Returns TRUE if the program must stop
+int run_scenario(long long now)
+{
+    while (scn.next < scn.count && scn.start + scn.events[scn.next].at <= now)
+    {
+        struct event *event = &scn.events[scn.next++];
+        printf("t=%.6fs (due %.6fs): %s\n", (now - scn.start) / 1.0e9, event->at / 1.0e9, event->command);
+        if (run_command(event->command))
+        {
+            return TRUE;
+        }
+    }
+
+    // Without a "quit", stop once the data that followed the last event is over
+    int carried = par.tx2rx.carried + par.rx2tx.carried > 0;
+    int idle = par.tx2rx.count == 0 && par.rx2tx.count == 0;
+    if (scn.count > 0 && scn.next == scn.count && carried && idle &&
+        now - scn.lastActivity >= SCENARIO_IDLE_NS && scn.lastActivity > scn.start + scn.events[scn.count - 1].at)
+    {
+        printf("END OF THE SCENARIO\n");
+        return TRUE;
+    }
+    return FALSE;
+}
+
+
+// Print what the cable did since it was ready
+void summary(long long now)
+{
+    printf("\nSUMMARY (%.3f s)\n", (now - scn.start) / 1.0e9);
+    if (scn.count > 0)
+    {
+        printf("Scenario events run: %d of %d\n", scn.next, scn.count);
+    }
+    struct direction *dirs[] = { &par.tx2rx, &par.rx2tx };
+    for (int i = 0; i < 2; i++)
+    {
+        struct direction *dir = dirs[i];
+        printf("%s: %lld bytes carried, %lld corrupted (%lld bit errors), %lld lost with the cable off\n", dir->name,
+               dir->carried, dir->corrupted, dir->bitErrors, dir->dropped);
+        if (dir->noise.gilbert && dir->carried > 0)
+        {
+            printf("   %.2f%% of the bytes in the bad state\n", 100.0 * dir->badBytes / (dir->carried + dir->dropped));
+        }
+    }
+    report_rate();
+}
+
+
+void usage(const char *program)
+{
+    printf("Usage: %s [-s <scenario file>] [-e \"<events>\"]\n"
+           "Events are \"t=<time> <command>\", separated by \";\" or new lines, with times in\n"
+           "s (default), ms or us since the cable is ready, e.g.\n"
+           "   %s -e \"t=0 baud 115200; t=2s ber 1e-4; t=5s off; t=5.5s on\"\n"
+           "With a scenario the cable exits on \"quit\", or once data went through it\n"
+           "after the last event and the line was then idle for 5 s.\n",
+           program, program);
+}
+
+
 int main(int argc, char *argv[])
 {
+    int option;
+    while ((option = getopt(argc, argv, "s:e:h")) != -1)
+    {
+        int res = 0;
+        switch (option)
+        {
+            case 's':
+                res = load_scenario(optarg);
+                break;
+            case 'e':
+                res = parse_scenario(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                exit(option == 'h' ? 0 : -1);
+        }
+        if (res < 0)
+        {
+            exit(-1);
+        }
+    }
+    qsort(scn.events, scn.count, sizeof(struct event), compare_events);
+
     printf("\n");
 
     system("socat -dd PTY,link=" TXDEV ",mode=777,raw,echo=0 PTY,link=/dev/emulatorTx,mode=777,raw,echo=0 &");
@@ -291,135 +1173,103 @@ int main(int argc, char *argv[])
     int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
     fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
 
-    char rxStdin[BUF_SIZE] = {0};
+    // Ports, commands and the timer all wake up a single epoll_wait()
+    par.epollFd = epoll_create1(0);
+    par.timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (par.epollFd < 0 || par.timerFd < 0)
+    {
+        perror("Creating epoll and timer");
+        exit(-1);
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = par.timerFd };
+    epoll_ctl(par.epollFd, EPOLL_CTL_ADD, par.timerFd, &event);
+    event.data.fd = STDIN_FILENO;
+    epoll_ctl(par.epollFd, EPOLL_CTL_ADD, STDIN_FILENO, &event);
+
+    par.tx2rx.inFd = fdTx;
+    par.tx2rx.outFd = fdRx;
+    par.rx2tx.inFd = fdRx;
+    par.rx2tx.outFd = fdTx;
+    watch_input(&par.tx2rx, TRUE);
+    watch_input(&par.rx2tx, TRUE);
 
     int STOP = FALSE;
 
     set_baud_rate(DEFAULT_BAUDRATE);
+    set_seed(DEFAULT_SEED);
 
     set_rt_priority();
 
     // For logging
-    char tx2rxTx[3], tx2rxRx[3], rx2txTx[3], rx2txRx[3];
     int cableIdle = FALSE;
 
     printf("\nCable ready\n\n");
+    fflush(stdout);
+    scn.start = now_ns();
+    scn.lastActivity = scn.start;
+    STOP = run_scenario(scn.start);
+    schedule_timer(scn.start);
 
-    // To compensate for deviations in byte transmission time
-    struct timespec currentTime, nextTxTime, timeDiff, nextWait;
-    int skipWait = FALSE;
     int unreliableRate = FALSE;
-    clock_gettime(CLOCK_MONOTONIC, &nextTxTime);
 
     while (STOP == FALSE)
     {
-        // Check how much waiting time we should have (if any)
-        clock_gettime(CLOCK_MONOTONIC, &currentTime);
-        timeDiff = timespec_diff(&currentTime, &nextTxTime);
-        nextTxTime = timespec_sum(&nextTxTime, &par.byteDelay);
-        if (timeDiff.tv_sec >= 1)
-        {
-            if (unreliableRate == FALSE)
-            {
-                printf("UNRELIABLE RATE: Could not keep up, timeDiff exceeded 1s\n"
-                       "No further warnings will be issued\n");
-                unreliableRate = TRUE;
-            }
-        }
-        nextWait = timespec_diff(&nextTxTime, &currentTime);
-        if (timespec_is_negative(&nextWait))
-        {
-            skipWait = TRUE;
-        }
-        else
-        {
-            skipWait = FALSE;
-        }
-
-        // Read from Tx
-        int bytesFromTx = read(fdTx, par.tx2rx + par.tx2rxIdx, 1);
-        par.tx2rxValid[par.tx2rxIdx] = bytesFromTx > 0;
-
-        // Read from Rx
-        int bytesFromRx = read(fdRx, par.rx2tx + par.rx2txIdx, 1);
-        par.rx2txValid[par.rx2txIdx] = bytesFromRx > 0;
-
-        if (!par.cableOn)
+        struct epoll_event events[MAX_EVENTS];
+        int ready = epoll_wait(par.epollFd, events, MAX_EVENTS, -1);
+        if (ready < 0)
         {
-            // Ignore what was read
-            par.tx2rxValid[par.tx2rxIdx] = 0;
-            par.rx2txValid[par.rx2txIdx] = 0;
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
         }
 
-        if (par.logfile != NULL)  // Currently logging
+        long long now = now_ns();
+        for (int i = 0; i < ready; i++)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
+            int fd = events[i].data.fd;
+            if (fd == par.timerFd)
             {
-                sprintf(tx2rxTx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
+                unsigned long long expirations;
+                read(par.timerFd, &expirations, sizeof(expirations));
             }
-            else
+            else if (fd == STDIN_FILENO)
             {
-                memcpy(tx2rxTx, "  ", 3);
+                STOP |= read_commands();
             }
-            if (par.rx2txValid[par.rx2txIdx])
+            else if (fd == fdTx)
             {
-                sprintf(rx2txTx, "%02hhX", par.rx2tx[par.rx2txIdx]);
+                take_input(&par.tx2rx, now, 0);
             }
-            else
+            else if (fd == fdRx)
             {
-                memcpy(rx2txTx, "  ", 3);
+                take_input(&par.rx2tx, now, 2);
             }
         }
 
-        // Advance indices to next position
-        par.tx2rxIdx = (par.tx2rxIdx + 1) % par.bufSize;
-        par.rx2txIdx = (par.rx2txIdx + 1) % par.bufSize;
-
-        if (par.cableOn)
+        now = now_ns();
+        STOP |= run_scenario(now);
+        if (!par.tx2rx.watched && par.tx2rx.resumeAt <= now)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.tx2rx[par.tx2rxIdx] ^= (char) 1 << rand() % 8;
-                }
-                write(fdRx, par.tx2rx + par.tx2rxIdx, 1);
-            }
+            watch_input(&par.tx2rx, TRUE);
+        }
+        if (!par.rx2tx.watched && par.rx2tx.resumeAt <= now)
+        {
+            watch_input(&par.rx2tx, TRUE);
+        }
 
-            if (par.rx2txValid[par.rx2txIdx])
-            {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.rx2tx[par.rx2txIdx] ^= (char) 1 << rand() % 8;
-                }
-                write(fdTx, par.rx2tx + par.rx2txIdx, 1);
-            }
+        long long lateTx = release_due(&par.tx2rx, now, 1);
+        long long lateRx = release_due(&par.rx2tx, now, 3);
+        if ((lateTx >= 1000000000LL || lateRx >= 1000000000LL) && unreliableRate == FALSE)
+        {
+            printf("UNRELIABLE RATE: Could not keep up, timeDiff exceeded 1s\n"
+                   "No further warnings will be issued\n");
+            unreliableRate = TRUE;
         }
 
         if (par.logfile != NULL)  // Currently logging
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                sprintf(tx2rxRx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
-            }
-            else
-            {
-                memcpy(tx2rxRx, "  ", 3);
-            }
-            if (par.rx2txValid[par.rx2txIdx])
-            {
-                sprintf(rx2txRx, "%02hhX", par.rx2tx[par.rx2txIdx]);
-            }
-            else
-            {
-                memcpy(rx2txRx, "  ", 3);
-            }
-
-            if (*tx2rxTx == ' ' && *rx2txTx == ' ' && *tx2rxRx == ' ' && *rx2txRx == ' ')
+            if (par.tx2rx.count == 0 && par.rx2tx.count == 0)
             {
                 if (cableIdle == FALSE)
                 {
@@ -429,115 +1279,16 @@ int main(int argc, char *argv[])
             }
             else
             {
-                fprintf(par.logfile, "%s  %s | %s  %s\n", tx2rxTx, tx2rxRx, rx2txTx, rx2txRx);
                 cableIdle = FALSE;
             }
         }
 
-        // Read commands from STDIN to control the cable mode
-        int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
-        if (fromStdin > 0)
-        {
-            rxStdin[fromStdin - 1] = '\0';
-
-            if (strcmp(rxStdin, "off") == 0)
-            {
-                printf("CONNECTION OFF\n");
-                if (par.cableOn && par.logfile != NULL)
-                {
-                    fputs("CABLE OFF\n", par.logfile);
-                }
-                par.cableOn = FALSE;
-            }
-            else if (strcmp(rxStdin, "on") == 0)
-            {
-                printf("CONNECTION ON\n");
-                par.cableOn = TRUE;
-            }
-            else if (strncmp(rxStdin, "ber ", 4) == 0)
-            {
-                double ber;
-                sscanf(rxStdin + 4, "%lf", &ber);
-                // Compute pow(1 - ber, 8) without libm
-                double acc = 1 - ber;
-                acc *= acc;   // Squared
-                acc *= acc;   // To the fourth
-                acc *= acc;   // To the eightth
-                par.byteER = 1.0 - acc;
-                //printf("Byte Error Rate is %lf\n", par.byteER);
-                if (ber >= 0.0 && ber < 1.0)
-                {
-                    printf("BER SET TO %lf\n", ber);
-                    if (ber > 0.01)
-                    {
-                        printf("   ACTUAL BER WILL BE LOWER THAN DEFINED FOR VALUES ABOVE 0.01\n");
-                    }
-                }
-                else
-                {
-                    printf("BAD BER VALUE %lf (MUST BE 0 <= BER < 1.0)", ber);
-                }
-            }
-            else if (strncmp(rxStdin, "baud ", 5) == 0)
-            {
-                unsigned long baud = 0;
-                sscanf(rxStdin + 5, "%lu", &baud);
-                switch (baud) {
-                    case 1200:
-                    case 1800:
-                    case 2400:
-                    case 4800:
-                    case 9600:
-                    case 19200:
-                    case 38400:
-                    case 57600:
-                    case 115200:
-                        set_baud_rate(baud);
-                        break;
-                    default:
-                        printf("UNSUPPORTED BAUD RATE: must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600 or 115200\n");
-                }
-            }
-            else if (strncmp(rxStdin, "prop ", 5) == 0)
-            {
-                unsigned long propDelay;
-                if (sscanf(rxStdin + 5, "%lu", &propDelay) < 1 || propDelay > 1000000)
-                {
-                    printf("BAD OR OUT OF RANGE PROPAGATION DELAY\n");
-                }
-                else
-                {
-                    par.propDelay = propDelay;
-                    init_ring_buffers();
-                }
-            }
-            else if (strncmp(rxStdin, "log ", 4) == 0)
-            {
-                startlog(rxStdin + 4);
-            }
-            else if (strcmp(rxStdin, "endlog") == 0)
-            {
-                endlog();
-                printf("NOT LOGGING\n");
-            }
-            else if (strcmp(rxStdin, "quit") == 0)
-            {
-                printf("END OF THE PROGRAM\n");
-                STOP = TRUE;
-            }
-            else if (strcmp(rxStdin, "help") == 0) {
-                help();
-            }
-            else {
-                printf("BAD COMMAND OR MISSING PARAMETERS\n");
-            }
-        }
-
-        if (skipWait == FALSE) {
-            nanosleep(&nextWait, NULL);
-        }
+        schedule_timer(now);
+        fflush(stdout);
     }
 
+    summary(now_ns());
+
     // Restore the old port settings
     if (tcsetattr(fdRx, TCSANOW, &oldtioRx) == -1)
     {
@@ -553,6 +1304,8 @@ int main(int argc, char *argv[])
 
     close(fdTx);
     close(fdRx);
+    close(par.timerFd);
+    close(par.epollFd);
 
     system("killall socat");
 
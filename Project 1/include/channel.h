@@ -0,0 +1,69 @@
+// Logical channels multiplexed over one link.
+// Each message is sent in fragments that start with a channel header, and a
+// weighted scheduler (deficit round robin) picks the channel of each fragment,
+// so a bulk transfer on one channel holds back the messages queued on another
+// for one fragment at most.
+//
+// All channels share the link's single modulo-8 sequence space and window:
+// the link layer orders and acknowledges the fragments, and the channel
+// header only tells them apart. Separate sequence spaces would need a window
+// per channel in the link layer for no gain on one line, where a lost frame
+// holds back every channel in any case until it is resent.
+
+#ifndef _CHANNEL_H_
+#define _CHANNEL_H_
+
+#include "link_layer_ext.h"
+
+// Channel header: channel number (bits 3-0) and CH_LAST on the last fragment
+// of a message.
+#define CH_HEADER_SIZE 1
+#define CH_LAST 0x80
+
+// Largest message that may be sent on a channel.
+#define CH_MAX_MESSAGE 65535
+
+// Largest fragment payload, also the scheduling quantum of a weight of 1.
+#define CH_MAX_FRAGMENT (MAX_PAYLOAD_SIZE - CH_HEADER_SIZE)
+
+// Messages each channel queues before chwrite() has to send some.
+#define CH_QUEUE_SIZE 8
+
+// Start multiplexing over the connection opened with llopen(), with the
+// channels agreed there (llchannels()), all of weight 1. Without channels
+// agreed, channel 0 is the only one and its messages go as they are, without
+// header nor fragments, up to llmaxpayload() bytes.
+// Return the number of channels or "-1" on error.
+int chopen(void);
+
+// Give "channel" "weight" (1..255) times the share of the line of a channel
+// of weight 1 while both have messages queued.
+// Return "1" on success or "-1" if the arguments are invalid.
+int chsetweight(int channel, int weight);
+
+// Queue a copy of "buf" to be sent on "channel". If the channel's queue is
+// full, fragments of all channels are sent until it has room.
+// Return "bufSize" or "-1" on error.
+int chwrite(int channel, const unsigned char *buf, int bufSize);
+
+// Messages queued on "channel", up to CH_QUEUE_SIZE, or "-1" if it is invalid.
+int chqueued(int channel);
+
+// Send the next fragment the scheduler picks.
+// Return "1" if one was sent, "0" if nothing is queued or "-1" on error.
+int chsend(void);
+
+// Send every message queued. Return "1" on success or "-1" on error.
+int chflush(void);
+
+// Receive the next complete message of any channel into "packet", which
+// should hold CH_MAX_MESSAGE bytes, and store its channel in "*channel".
+// Fragments of other channels are reassembled on the way.
+// Return the size of the message or "-1" on error.
+int chread(int *channel, unsigned char *packet, int packetSize);
+
+// Send every message queued and release the channels; llclose() follows.
+// Return "1" on success or "-1" on error.
+int chclose(void);
+
+#endif // _CHANNEL_H_
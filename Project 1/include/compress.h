@@ -0,0 +1,16 @@
+// Fast block compression in the LZ4 block format: each sequence is a run of
+// literals followed by a back-reference of at least 4 bytes into the block.
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+// Compress "size" (at most 65535) bytes of "in" into at most "outSpace" bytes of "out".
+// Return the compressed size, or "-1" if the block does not compress into
+// "outSpace" bytes and is better sent as is.
+int compressBlock(const unsigned char *in, int size, unsigned char *out, int outSpace);
+
+// Decompress a block of "size" bytes into at most "outSpace" bytes of "out".
+// Return the decompressed size, or "-1" if the block is malformed or does not fit.
+int decompressBlock(const unsigned char *in, int size, unsigned char *out, int outSpace);
+
+#endif // _COMPRESS_H_
@@ -0,0 +1,34 @@
+// Cyclic redundancy checks used as frame check sequence (BCC2).
+
+#ifndef _CRC_H_
+#define _CRC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-16/X-25, the HDLC FCS-16: reflected polynomial 0x1021.
+// The update functions work on the raw register: start from CRC16_INIT and
+// XOR the result with CRC16_XOROUT to get the value that goes in the frame
+// (least significant byte first). Running the register over the data followed
+// by its CRC leaves CRC16_RESIDUE.
+#define CRC16_INIT 0xFFFF
+#define CRC16_XOROUT 0xFFFF
+#define CRC16_RESIDUE 0xF0B8
+
+// CRC-32 (IEEE 802.3), the HDLC FCS-32: reflected polynomial 0x04C11DB7.
+// Same conventions as CRC-16.
+#define CRC32_INIT 0xFFFFFFFF
+#define CRC32_XOROUT 0xFFFFFFFF
+#define CRC32_RESIDUE 0xDEBB20E3
+
+// Update a CRC-16 register with "size" bytes, using slicing-by-8 tables.
+uint16_t crc16Update(uint16_t crc, const unsigned char *buf, size_t size);
+
+// Update a CRC-32 register with "size" bytes. Uses carry-less multiplication
+// (PCLMULQDQ) on CPUs that support it and slicing-by-8 tables otherwise.
+uint32_t crc32Update(uint32_t crc, const unsigned char *buf, size_t size);
+
+// Same as crc32Update() but always uses the slicing-by-8 tables.
+uint32_t crc32UpdatePortable(uint32_t crc, const unsigned char *buf, size_t size);
+
+#endif // _CRC_H_
@@ -0,0 +1,62 @@
+// Reed-Solomon forward error correction: RS(255,223) over GF(256).
+
+#ifndef _FEC_H_
+#define _FEC_H_
+
+#include <stddef.h>
+
+// Each codeword holds up to FEC_DATA message bytes and FEC_PARITY parity bytes
+// and corrects up to FEC_PARITY / 2 corrupted bytes. A message is split evenly
+// over shortened codewords, at least as many as the interleaving depth, whose
+// bytes are interleaved: a burst of errors hits each codeword depth times less.
+#define FEC_CODEWORD 255
+#define FEC_PARITY 32
+#define FEC_DATA (FEC_CODEWORD - FEC_PARITY)
+#define FEC_MAX_DEPTH 32
+
+#define FEC_CODEWORDS(size) (((size) + FEC_DATA - 1) / FEC_DATA)
+
+// Encoded size of "size" message bytes with an interleaving depth of 1, and an
+// upper bound for any depth.
+#define FEC_ENCODED_SIZE(size) ((size) + FEC_PARITY * FEC_CODEWORDS(size))
+#define FEC_MAX_ENCODED_SIZE(size) (FEC_ENCODED_SIZE(size) + FEC_PARITY * FEC_MAX_DEPTH)
+
+// Implementations of the GF(256) multiply-accumulate used by the decoder.
+// The SIMD ones look up the products of the low and high nibbles with PSHUFB,
+// 16 or 32 bytes at a time.
+typedef enum
+{
+    FecScalar,
+    FecSsse3,
+    FecAvx2,
+} FecKernel;
+
+// Encoded size of "size" message bytes interleaved "depth" (1..FEC_MAX_DEPTH) deep.
+size_t fecEncodedSize(size_t size, int depth);
+
+// Size of the message encoded in "encodedSize" bytes with "depth", or "-1" if
+// no message encodes to that size.
+long fecMessageSize(size_t encodedSize, int depth);
+
+// Encode "size" bytes of "in" into fecEncodedSize(size, depth) bytes of "out".
+// Return the number of bytes written.
+size_t fecEncode(const unsigned char *in, size_t size, int depth, unsigned char *out);
+
+// Correct the "size" encoded bytes of "in", encoded with the same "depth", and
+// write the message to "out", storing its size in "*messageSize".
+// Return the number of bytes corrected or "-1" if a codeword has more errors
+// than the code can correct (the message may then be partly corrected) or
+// "size" is not the size of an encoded message.
+int fecDecode(const unsigned char *in, size_t size, int depth, unsigned char *out, size_t *messageSize);
+
+// dst[i] ^= c * src[i] in GF(256), for "size" bytes.
+void gfMulAddRegion(unsigned char *dst, const unsigned char *src, unsigned char c, size_t size);
+
+// Best kernel supported by this CPU, used by default.
+FecKernel fecBestKernel(void);
+
+// Use "kernel" for the following calls.
+// Return "1" on success or "-1" if the CPU does not support it.
+int fecSelectKernel(FecKernel kernel);
+
+#endif // _FEC_H_
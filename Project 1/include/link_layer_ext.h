@@ -0,0 +1,136 @@
+// Link layer extensions header.
+// Options and calls that go beyond the fixed interface of link_layer.h.
+
+#ifndef _LINK_LAYER_EXT_H_
+#define _LINK_LAYER_EXT_H_
+
+#include "link_layer.h"
+#include "statistics.h"
+
+// Automatic repeat request scheme used for I-frames.
+typedef enum
+{
+    LlStopAndWait,
+    LlGoBackN,
+    LlSelectiveRepeat,
+} LinkLayerArq;
+
+// Frame check sequence carried in BCC2.
+typedef enum
+{
+    LlCheckXor,   // 1 byte, XOR of the payload bytes
+    LlCheckCrc16, // 2 bytes, CRC-16/X-25 (HDLC FCS-16)
+    LlCheckCrc32, // 4 bytes, CRC-32 (HDLC FCS-32)
+} LinkLayerFrameCheck;
+
+// Sequence numbers are carried modulo 8 in the control field.
+#define LL_SEQ_MODULO 8
+
+// Largest payload that may be negotiated for jumbo frames.
+#define LL_MAX_JUMBO_PAYLOAD 65535
+
+// Most logical channels that may be negotiated, see channel.h.
+#define LL_MAX_CHANNELS 16
+
+typedef struct
+{
+    LinkLayerArq arq;
+    int windowSize; // Maximum number of unacknowledged I-frames
+                    // (Go-Back-N: 1..7, Selective Repeat: 1..4)
+    LinkLayerFrameCheck frameCheck;
+    int maxPayloadSize; // Largest payload to offer in SET/UA
+                        // (MAX_PAYLOAD_SIZE..LL_MAX_JUMBO_PAYLOAD)
+    int adaptiveFrameSize; // Transmitter: offer segmentation in SET and adapt
+                           // the frame size to the observed error rate
+    int forwardErrorCorrection; // Transmitter: offer Reed-Solomon RS(255,223)
+                                // parity in I-frames, corrected without resending
+    int fecInterleaveDepth; // Transmitter: codewords interleaved in each I-frame
+                            // at least (1..32), which spreads a burst over them.
+                            // The parity covers the data before byte stuffing,
+                            // so only bursts that create or destroy no FLAG or
+                            // ESC byte, and so leave the framing intact, can be
+                            // corrected; the others cost the frame
+    int fullDuplex; // Both ends: let both llwrite() and llread(), with N(R)
+                    // piggybacked on I-frames. Segmentation is not used then,
+                    // so adaptiveFrameSize has no effect
+    int channels; // Both ends: logical channels to offer (1..LL_MAX_CHANNELS),
+                  // multiplexed in the payloads by channel.h
+    int features; // Both ends: bits the application defines (0..255), offered
+                  // in SET/UA; those that both ends offer are agreed
+} LinkLayerOptions;
+
+// Fill "options" with the defaults (Stop-and-Wait, window of 1, XOR BCC2,
+// no jumbo frames, fixed frame size, no FEC, interleaving depth of 1, one-way,
+// a single channel, no application features).
+void lldefaultoptions(LinkLayerOptions *options);
+
+// Set the options used by the next call to llopen().
+// Both ends must use the same ARQ scheme, window size and frame check.
+// Return "1" on success or "-1" if the options are invalid.
+int llsetoptions(const LinkLayerOptions *options);
+
+// Largest payload agreed with the peer during llopen(): the smaller of both
+// maxPayloadSize options, or MAX_PAYLOAD_SIZE if the peer does not negotiate.
+// With segmentation agreed (adaptiveFrameSize), LL_MAX_JUMBO_PAYLOAD: payloads
+// are split in frames of the adapted size and reassembled by the receiver.
+// Return "-1" if the connection is not open.
+int llmaxpayload(void);
+
+// Same as llwrite() for payloads of up to llmaxpayload() bytes.
+// Return the total size of the frames sent.
+int llwritejumbo(const unsigned char *buf, int bufSize);
+
+// Same as llread() with a "packet" buffer of "packetSize" bytes, which should
+// hold llmaxpayload() bytes. Frames larger than the buffer are an error.
+int llreadjumbo(unsigned char *packet, int packetSize);
+
+// TRUE if full duplex was agreed during llopen(): both ends may then call
+// llwrite() and llread() in any order. Frames that arrive while llwrite() waits
+// for acknowledgements are kept for llread(), a few at most; beyond that they
+// are left unacknowledged until the application reads, so an application that
+// writes a lot without reading stalls once the peer does the same.
+// Return "-1" if the connection is not open.
+int llfullduplex(void);
+
+// Messages given to llsubmit() that may be pending at once.
+#define LL_MAX_SUBMISSIONS 16
+
+// Called when a message given to llsubmit() completes, with its handle and
+// "context": "result" is the total size of its frames once every frame is
+// acknowledged, or "-1" if the connection failed first. It may submit more.
+typedef void (*LlCompletion)(int handle, int result, void *context);
+
+// Start sending "buf" without waiting for acknowledgements: its first frames
+// go out at once if the window has room, and the rest as llpoll(), llwait()
+// or later calls make progress. "buf" must stay valid until the message
+// completes. Messages are sent in order, also with llwrite() calls after them.
+// If LL_MAX_SUBMISSIONS messages are pending, wait for the oldest first.
+// Return a handle (positive, increasing from 1 on each connection) or "-1"
+// if the arguments are invalid or an earlier message failed.
+int llsubmit(const unsigned char *buf, int bufSize, LlCompletion callback, void *context);
+
+// Take the acknowledgements and timeouts that are due and send more of the
+// submitted messages, waiting up to "timeoutMs" (0 to never block, -1 for no
+// limit) for an event while frames are outstanding. Completion callbacks run
+// from here, or from any other call that takes acknowledgements.
+// Return the number of messages completed or "-1" on error.
+int llpoll(int timeoutMs);
+
+// Wait until the message with "handle" completes.
+// Return "1" if it was acknowledged or "-1" if it failed or is unknown.
+int llwait(int handle);
+
+// Number of logical channels agreed during llopen(): the smaller of both
+// channels options, or 1 if the peer does not negotiate them.
+// Return "-1" if the connection is not open.
+int llchannels(void);
+
+// Application feature bits agreed during llopen(): those of the features
+// option that the peer offered too, or 0 if the peer does not negotiate them.
+// Return "-1" if the connection is not open.
+int llfeatures(void);
+
+// Statistics of the current connection, or of the last one once closed.
+const LinkStatistics *llstatistics(void);
+
+#endif // _LINK_LAYER_EXT_H_
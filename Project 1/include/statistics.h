@@ -0,0 +1,69 @@
+// Link statistics: frame and byte counters, round trip times, and the
+// efficiency achieved compared with the theoretical one for the line.
+
+#ifndef _STATISTICS_H_
+#define _STATISTICS_H_
+
+#include <stdio.h>
+
+// Round trip times kept for the percentiles; the latest ones when there are more
+#define STATS_RTT_SAMPLES 4096
+
+typedef struct
+{
+    // Line and ARQ, for the theoretical efficiency
+    int baudRate;
+    int windowSize;      // Frames in flight, 1 for Stop-and-Wait
+    int selectiveRepeat; // TRUE if only the lost frames are resent, FALSE for Go-Back-N or Stop-and-Wait
+
+    long long startUs; // Connection established, in CLOCK_MONOTONIC us
+    long long endUs;   // Disconnection started, 0 while open
+
+    // Frames, counted on every transmission
+    long iFramesSent;
+    long sFramesSent;
+    long uFramesSent;
+    long iFramesReceived; // With a valid header, whatever their BCC2
+    long sFramesReceived;
+    long uFramesReceived;
+
+    long retransmissions; // I-frames sent again, for any reason
+    long frameAttempts;   // Transmissions of the I-frames acknowledged
+    long frameFailures;   // Those that timed out or were asked for again
+    long timeouts;        // Timer expirations that made us resend
+    long rejSent;
+    long rejReceived;
+    long rejIgnored; // Received for frames already resent
+    long srejSent;
+    long srejReceived;
+    long srejIgnored;
+    long bcc1Errors; // Headers dropped for a wrong BCC1
+    long bcc2Errors; // I-frames dropped for a wrong BCC2
+
+    // Bytes on the wire, escapes added by byte stuffing, and payload carried:
+    // acknowledged by the peer when sent, delivered to llread() when received
+    long long wireBytesSent;
+    long long wireBytesReceived;
+    long long iFrameBytesSent;
+    long long stuffingBytesSent;
+    long long stuffingBytesReceived;
+    long long payloadBytesSent;
+    long long payloadBytesReceived;
+
+    // Round trip times of frames sent once, in us
+    long rttCount;
+    long long rttSum;
+    long long rttMin;
+    long long rttSamples[STATS_RTT_SAMPLES];
+} LinkStatistics;
+
+// Clear "stats" for a connection established at "startUs".
+void statsReset(LinkStatistics *stats, int baudRate, int windowSize, int selectiveRepeat, long long startUs);
+
+void statsRecordRtt(LinkStatistics *stats, long long rtt);
+
+// Print "stats" for people, or as a single JSON object.
+void statsPrint(FILE *out, const LinkStatistics *stats);
+void statsPrintJson(FILE *out, const LinkStatistics *stats);
+
+#endif // _STATISTICS_H_
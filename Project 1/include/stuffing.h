@@ -0,0 +1,42 @@
+// Byte stuffing of frame contents: FLAG and ESC are sent as ESC, byte ^ ESC_MASK.
+
+#ifndef _STUFFING_H_
+#define _STUFFING_H_
+
+#include <stddef.h>
+
+#define FLAG 0x7E
+#define ESC 0x7D
+#define ESC_MASK 0x20
+
+// Implementations of the kernels. The SIMD ones scan 16 or 32 bytes at a time,
+// copy runs without FLAG/ESC in bulk and only escape the hits.
+typedef enum
+{
+    StuffingScalar,
+    StuffingSse2,
+    StuffingAvx2,
+} StuffingKernel;
+
+// Stuff "size" bytes of "in" into "out", which must have room for 2 * size bytes.
+// Return the number of bytes written.
+size_t stuffBytes(const unsigned char *in, size_t size, unsigned char *out);
+
+// Destuff "in" into "out" until a FLAG is found or "outSpace" bytes were
+// written. The FLAG is not consumed. "*escaped" carries an ESC that ended the
+// previous call and is updated on return; the number of bytes written is
+// stored in "*written". Return the number of bytes consumed from "in".
+size_t destuffBytes(const unsigned char *in, size_t size, unsigned char *out, size_t outSpace,
+                    size_t *written, int *escaped);
+
+// Return the number of leading bytes of "in" that need no escaping.
+size_t stuffingCleanRun(const unsigned char *in, size_t size);
+
+// Best kernel supported by this CPU, used by default.
+StuffingKernel stuffingBestKernel(void);
+
+// Use "kernel" for the following calls.
+// Return "1" on success or "-1" if the CPU does not support it.
+int stuffingSelectKernel(StuffingKernel kernel);
+
+#endif // _STUFFING_H_
@@ -1,9 +1,951 @@
 // Application layer protocol implementation
 
 #include "application_layer.h"
+#include "channel.h"
+#include "compress.h"
+#include "link_layer.h"
+#include "link_layer_ext.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Control field of the application packets
+#define C_START 1
+#define C_DATA 2
+#define C_END 3
+#define C_DATA_COMPRESSED 4
+
+// Parameter types of the control packets
+#define T_FILE_SIZE 0
+#define T_FILE_NAME 1
+#define T_COMPRESSION 2
+
+// Values of T_COMPRESSION: the data packets that are not sent as is
+#define COMPRESSION_LZ4 1
+
+// Link layer feature bits offered in SET/UA: what this end can receive
+#define FEATURE_LZ4 0x01
+
+// Data packets carry C, L2, L1 before the file bytes
+#define DATA_HEADER_SIZE 3
+
+// Compressed data packets carry C, L2, L1 (compressed size), O2, O1 (original
+// size) before the compressed bytes
+#define COMPRESSED_HEADER_SIZE 5
+
+#define MAX_FILE_NAME 255
+
+// main.c has no room for link layer options, so they are read from the environment:
+//   LL_ARQ=saw|gbn|sr  ARQ scheme (default: saw)
+//   LL_WINDOW=n        Window size for Go-Back-N (default: 7) or Selective Repeat (default: 4)
+//   LL_CHECK=xor|crc16|crc32  Frame check sequence in BCC2 (default: xor)
+//   LL_MAX_PAYLOAD=n   Largest packet to negotiate, up to 65535 (default: MAX_PAYLOAD_SIZE)
+//   LL_ADAPT=1         Adapt the frame size to the error rate (transmitter)
+//   LL_FEC=1           Reed-Solomon forward error correction of I-frames (transmitter)
+//   LL_FEC_DEPTH=n     Codewords interleaved in each I-frame at least, 1 to 32 (default: 1)
+//   LL_DUPLEX=1        Full duplex, both ends send I-frames (both ends)
+//   LL_CHANNELS=n      Logical channels to offer, 1 to 16 (both ends, default: 1)
+//   LL_BAUD=n          Baud rate instead of the one main.c passes, to match the cable (both ends)
+static void loadLinkOptions(LinkLayerOptions *options)
+{
+    lldefaultoptions(options);
+
+    const char *arq = getenv("LL_ARQ");
+    if (arq != NULL && strcmp(arq, "gbn") == 0)
+    {
+        options->arq = LlGoBackN;
+        options->windowSize = LL_SEQ_MODULO - 1;
+    }
+    else if (arq != NULL && strcmp(arq, "sr") == 0)
+    {
+        options->arq = LlSelectiveRepeat;
+        options->windowSize = LL_SEQ_MODULO / 2;
+    }
+
+    const char *window = getenv("LL_WINDOW");
+    if (window != NULL && options->arq != LlStopAndWait)
+    {
+        options->windowSize = atoi(window);
+    }
+
+    const char *check = getenv("LL_CHECK");
+    if (check != NULL && strcmp(check, "crc16") == 0)
+    {
+        options->frameCheck = LlCheckCrc16;
+    }
+    else if (check != NULL && strcmp(check, "crc32") == 0)
+    {
+        options->frameCheck = LlCheckCrc32;
+    }
+
+    const char *maxPayload = getenv("LL_MAX_PAYLOAD");
+    if (maxPayload != NULL)
+    {
+        options->maxPayloadSize = atoi(maxPayload);
+    }
+
+    const char *adapt = getenv("LL_ADAPT");
+    if (adapt != NULL)
+    {
+        options->adaptiveFrameSize = atoi(adapt) != 0;
+    }
+
+    const char *fec = getenv("LL_FEC");
+    if (fec != NULL)
+    {
+        options->forwardErrorCorrection = atoi(fec) != 0;
+    }
+
+    const char *depth = getenv("LL_FEC_DEPTH");
+    if (depth != NULL)
+    {
+        options->fecInterleaveDepth = atoi(depth);
+    }
+
+    const char *duplex = getenv("LL_DUPLEX");
+    if (duplex != NULL)
+    {
+        options->fullDuplex = atoi(duplex) != 0;
+    }
+
+    const char *channels = getenv("LL_CHANNELS");
+    if (channels != NULL)
+    {
+        options->channels = atoi(channels);
+    }
+
+    // Every end decompresses, so the sender may compress once the peer offers it too
+    options->features = FEATURE_LZ4;
+}
+
+// main.c has no room for application layer options either:
+//   APP_COMPRESS=1     Compress the data packets that get smaller (sending end)
+//   APP_EXCHANGE=file  With full duplex, also the file the receiver sends and
+//                      the transmitter writes (both ends)
+//   APP_CHANNEL_FILE=file  With LL_CHANNELS, a second file sent on channel 1
+//                      while the first goes on channel 0 (both ends)
+//   APP_CHANNEL_WEIGHTS=w0,w1  Scheduler weights of channels 0 and 1 (sending end, default: 1,1)
+//   APP_STATS=file     Also write the link statistics as JSON to "file"
+//   APP_PACKET_SIZE=n  Largest data packet, if smaller than the link layer carries (sending end)
+// Compression asked for with APP_COMPRESS, if the peer agreed during llopen()
+// that it decompresses: a peer that does not know the feature gets raw packets.
+static int loadCompression(void)
+{
+    const char *compress = getenv("APP_COMPRESS");
+    if (compress == NULL || atoi(compress) == 0)
+    {
+        return 0;
+    }
+    if ((llfeatures() & FEATURE_LZ4) == 0)
+    {
+        printf("The peer does not decompress, sending the data packets as is\n");
+        return 0;
+    }
+    return COMPRESSION_LZ4;
+}
+
+// Packets a file sender keeps in flight with llsubmit(): enough to fill a
+// window of "windowSize" frames with one more being read and compressed, and
+// never fewer than the largest window (LL_SEQ_MODULO - 1), up to
+// LL_MAX_SUBMISSIONS.
+static int sendDepth(int windowSize)
+{
+    int depth = windowSize + 1;
+    if (depth < LL_SEQ_MODULO - 1)
+    {
+        depth = LL_SEQ_MODULO - 1;
+    }
+    return depth < LL_MAX_SUBMISSIONS ? depth : LL_MAX_SUBMISSIONS;
+}
+
+// Weights of channels 0 and 1 from APP_CHANNEL_WEIGHTS, 1 if not given.
+static void loadChannelWeights(int weights[2])
+{
+    weights[0] = 1;
+    weights[1] = 1;
+    const char *text = getenv("APP_CHANNEL_WEIGHTS");
+    if (text != NULL)
+    {
+        sscanf(text, "%d,%d", &weights[0], &weights[1]);
+    }
+}
+
+// Largest data packet to send: "maxPacketSize", or less with APP_PACKET_SIZE.
+static int loadPacketSize(int maxPacketSize)
+{
+    const char *size = getenv("APP_PACKET_SIZE");
+    int packetSize = size != NULL ? atoi(size) : 0;
+    return packetSize > COMPRESSED_HEADER_SIZE && packetSize < maxPacketSize ? packetSize : maxPacketSize;
+}
+
+// Write the link statistics as JSON to the file named in APP_STATS, if any.
+static void saveStatistics(void)
+{
+    const char *path = getenv("APP_STATS");
+    if (path == NULL)
+    {
+        return;
+    }
+
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        perror(path);
+        return;
+    }
+    statsPrintJson(file, llstatistics());
+    fclose(file);
+}
+
+// Build a start or end control packet, announcing "compression" if not 0.
+// Return the packet size.
+static int buildControlPacket(unsigned char *packet, unsigned char c, long fileSize, const char *fileName,
+                              int compression)
+{
+    int size = 0;
+    packet[size++] = c;
+
+    // File size, big-endian, using as few bytes as needed
+    int sizeLength = 1;
+    while (sizeLength < (int) sizeof(long) && (fileSize >> (8 * sizeLength)) > 0)
+    {
+        sizeLength++;
+    }
+    packet[size++] = T_FILE_SIZE;
+    packet[size++] = sizeLength;
+    for (int i = sizeLength - 1; i >= 0; i--)
+    {
+        packet[size++] = (fileSize >> (8 * i)) & 0xFF;
+    }
+
+    int nameLength = strlen(fileName);
+    if (nameLength > MAX_FILE_NAME)
+    {
+        nameLength = MAX_FILE_NAME;
+    }
+    packet[size++] = T_FILE_NAME;
+    packet[size++] = nameLength;
+    memcpy(packet + size, fileName, nameLength);
+    size += nameLength;
+
+    // Only sent once the peer agreed on FEATURE_LZ4 in SET/UA, so it knows
+    // this parameter and the compressed data packets
+    if (compression != 0)
+    {
+        packet[size++] = T_COMPRESSION;
+        packet[size++] = 1;
+        packet[size++] = compression;
+    }
+
+    return size;
+}
+
+// Parse a start or end control packet.
+// Return "0" on success or "-1" if the packet is malformed.
+static int parseControlPacket(const unsigned char *packet, int size, long *fileSize, char *fileName,
+                              int *compression)
+{
+    *fileSize = -1;
+    fileName[0] = '\0';
+    *compression = 0;
+
+    int i = 1;
+    while (i + 2 <= size)
+    {
+        unsigned char type = packet[i];
+        unsigned char length = packet[i + 1];
+        const unsigned char *value = packet + i + 2;
+        if (i + 2 + length > size)
+        {
+            return -1;
+        }
+
+        if (type == T_FILE_SIZE && length <= sizeof(long))
+        {
+            *fileSize = 0;
+            for (int j = 0; j < length; j++)
+            {
+                *fileSize = (*fileSize << 8) | value[j];
+            }
+        }
+        else if (type == T_FILE_NAME)
+        {
+            memcpy(fileName, value, length);
+            fileName[length] = '\0';
+        }
+        else if (type == T_COMPRESSION && length == 1)
+        {
+            *compression = value[0];
+        }
+
+        i += 2 + length;
+    }
+
+    return i == size ? 0 : -1;
+}
+
+// A file sent one packet at a time: the start packet, the data packets and
+// the end packet.
+typedef struct
+{
+    FILE *file;
+    const char *name;
+    long fileSize;
+    long bytesSent;
+    long packetBytes; // Size of the data packets, smaller than bytesSent with compression
+    int compression;
+    int maxPacketSize;
+    int dataPacketSize; // Largest data packet, up to maxPacketSize
+    int depth; // Packets in flight: 1 sends each with llwritejumbo(), more submit them with llsubmit()
+    int channel; // Logical channel the packets are queued on with chwrite(), -1 to use the link layer
+    unsigned char *packets[LL_MAX_SUBMISSIONS];
+    unsigned char *compressedPackets[LL_MAX_SUBMISSIONS];
+    int handles[LL_MAX_SUBMISSIONS]; // Submission of the packet in each buffer, 0 if none is pending
+    int current; // Buffers of the packet being prepared
+    unsigned char *packet; // packets[current]
+    unsigned char *compressed; // compressedPackets[current]
+    unsigned char next; // Control field of the next packet to send
+} FileSender;
+
+// A file received one packet at a time.
+typedef struct
+{
+    FILE *file;
+    const char *name;
+    long fileSize; // From the start packet, "-1" if unknown
+    long bytesReceived;
+    int compression;
+    int started;
+    int maxPacketSize;
+    unsigned char *packet;
+    unsigned char *block; // Decompressed data
+} FileReceiver;
+
+static void freeSenderBuffers(FileSender *sender)
+{
+    for (int i = 0; i < sender->depth; i++)
+    {
+        free(sender->packets[i]);
+        free(sender->compressedPackets[i]);
+    }
+}
+
+// Open "filename" to be sent with "depth" packets in flight (1..LL_MAX_SUBMISSIONS).
+// Return "0" on success or "-1" on error.
+static int openSender(FileSender *sender, const char *filename, int compression, int depth)
+{
+    memset(sender, 0, sizeof(*sender));
+    sender->file = fopen(filename, "rb");
+    if (sender->file == NULL)
+    {
+        perror(filename);
+        return -1;
+    }
+
+    fseek(sender->file, 0, SEEK_END);
+    sender->fileSize = ftell(sender->file);
+    fseek(sender->file, 0, SEEK_SET);
+
+    // Packets as large as the link layer agreed to carry
+    sender->name = filename;
+    sender->compression = compression;
+    sender->maxPacketSize = llmaxpayload();
+    sender->dataPacketSize = loadPacketSize(sender->maxPacketSize);
+    sender->depth = depth;
+    sender->channel = -1;
+    sender->next = C_START;
+    int failed = FALSE;
+    for (int i = 0; i < depth; i++)
+    {
+        sender->packets[i] = malloc(sender->maxPacketSize);
+        sender->compressedPackets[i] = compression != 0 ? malloc(sender->maxPacketSize) : NULL;
+        failed |= sender->packets[i] == NULL || (compression != 0 && sender->compressedPackets[i] == NULL);
+    }
+    if (failed)
+    {
+        printf("Out of memory\n");
+        freeSenderBuffers(sender);
+        fclose(sender->file);
+        return -1;
+    }
+    sender->packet = sender->packets[0];
+    sender->compressed = sender->compressedPackets[0];
+    return 0;
+}
+
+// Wait until every packet submitted is acknowledged.
+// Return "0" on success or "-1" if one of them failed.
+static int waitPackets(FileSender *sender)
+{
+    int res = 0;
+    for (int i = 0; i < sender->depth; i++)
+    {
+        if (sender->handles[i] > 0 && llwait(sender->handles[i]) < 0)
+        {
+            res = -1;
+        }
+        sender->handles[i] = 0;
+    }
+    return res;
+}
+
+// Submitted packets reference the buffers until they complete
+static void closeSender(FileSender *sender)
+{
+    waitPackets(sender);
+    freeSenderBuffers(sender);
+    fclose(sender->file);
+}
+
+// Send the packet in "buf", which is the current packet or compressed buffer.
+// With more than one packet in flight, submit it and move on to the next
+// buffers, waiting for the packet that used them last.
+// Return "0" on success or "-1" on error.
+static int transmitPacket(FileSender *sender, const unsigned char *buf, int size)
+{
+    // chwrite() queues a copy, so the buffers are free again at once
+    if (sender->channel >= 0)
+    {
+        return chwrite(sender->channel, buf, size) < 0 ? -1 : 0;
+    }
+    if (sender->depth == 1)
+    {
+        return llwritejumbo(buf, size) < 0 ? -1 : 0;
+    }
+
+    int handle = llsubmit(buf, size, NULL, NULL);
+    if (handle < 0)
+    {
+        return -1;
+    }
+    sender->handles[sender->current] = handle;
+
+    sender->current = (sender->current + 1) % sender->depth;
+    int previous = sender->handles[sender->current];
+    sender->handles[sender->current] = 0;
+    sender->packet = sender->packets[sender->current];
+    sender->compressed = sender->compressedPackets[sender->current];
+    return previous > 0 && llwait(previous) < 0 ? -1 : 0;
+}
+
+// Send the next data packet, compressed if that makes it smaller.
+// Return "1" if one was sent, "0" at the end of the file or "-1" on error.
+static int sendDataPacket(FileSender *sender)
+{
+    unsigned char *packet = sender->packet;
+    unsigned char *compressed = sender->compressed;
+    int dataSize = fread(packet + DATA_HEADER_SIZE, 1, sender->dataPacketSize - DATA_HEADER_SIZE, sender->file);
+    if (dataSize <= 0)
+    {
+        return 0;
+    }
+
+    packet[0] = C_DATA;
+    packet[1] = (dataSize >> 8) & 0xFF;
+    packet[2] = dataSize & 0xFF;
+    const unsigned char *toSend = packet;
+    int packetSize = DATA_HEADER_SIZE + dataSize;
+
+    // Blocks that do not get smaller than as is, like most of a GIF, stay C_DATA
+    int space = DATA_HEADER_SIZE + dataSize - COMPRESSED_HEADER_SIZE - 1;
+    int compressedSize;
+    if (sender->compression != 0 && space > 0 &&
+        (compressedSize = compressBlock(packet + DATA_HEADER_SIZE, dataSize, compressed + COMPRESSED_HEADER_SIZE,
+                                        space)) >= 0)
+    {
+        compressed[0] = C_DATA_COMPRESSED;
+        compressed[1] = (compressedSize >> 8) & 0xFF;
+        compressed[2] = compressedSize & 0xFF;
+        compressed[3] = (dataSize >> 8) & 0xFF;
+        compressed[4] = dataSize & 0xFF;
+        toSend = compressed;
+        packetSize = COMPRESSED_HEADER_SIZE + compressedSize;
+    }
+
+    if (transmitPacket(sender, toSend, packetSize) < 0)
+    {
+        printf("Failed to send data packet at byte %ld\n", sender->bytesSent);
+        return -1;
+    }
+    sender->bytesSent += dataSize;
+    sender->packetBytes += packetSize;
+    return 1;
+}
+
+// Send the next packet of the file.
+// Return "1" if more follow, "0" once the end packet was sent or "-1" on error.
+static int sendNextPacket(FileSender *sender)
+{
+    if (sender->next == C_DATA)
+    {
+        int res = sendDataPacket(sender);
+        if (res != 0)
+        {
+            return res;
+        }
+        sender->next = C_END;
+    }
+
+    unsigned char c = sender->next;
+    int packetSize = buildControlPacket(sender->packet, c, sender->fileSize, sender->name, sender->compression);
+    if (transmitPacket(sender, sender->packet, packetSize) < 0)
+    {
+        printf("Failed to send %s packet\n", c == C_START ? "start" : "end");
+        return -1;
+    }
+    if (c == C_START)
+    {
+        sender->next = C_DATA;
+        return 1;
+    }
+
+    if (waitPackets(sender) < 0)
+    {
+        printf("Failed to send the last packets\n");
+        return -1;
+    }
+
+    if (sender->compression != 0)
+    {
+        printf("File sent: %ld bytes in %ld bytes of data packets\n", sender->bytesSent, sender->packetBytes);
+    }
+    else
+    {
+        printf("File sent: %ld bytes\n", sender->bytesSent);
+    }
+    return 0;
+}
+
+// Return "0" on success or "-1" on error.
+static int openReceiver(FileReceiver *receiver, const char *filename)
+{
+    memset(receiver, 0, sizeof(*receiver));
+    receiver->file = fopen(filename, "wb");
+    if (receiver->file == NULL)
+    {
+        perror(filename);
+        return -1;
+    }
+
+    // Compressed packets expand to at most the largest data packet's file bytes
+    receiver->name = filename;
+    receiver->fileSize = -1;
+    receiver->maxPacketSize = llmaxpayload();
+    receiver->packet = malloc(receiver->maxPacketSize);
+    receiver->block = malloc(receiver->maxPacketSize);
+    if (receiver->packet == NULL || receiver->block == NULL)
+    {
+        printf("Out of memory\n");
+        free(receiver->packet);
+        free(receiver->block);
+        fclose(receiver->file);
+        return -1;
+    }
+    return 0;
+}
+
+// Close the file, checking that all of it arrived if "complete".
+// Return "0" on success or "-1" on error.
+static int closeReceiver(FileReceiver *receiver, int complete)
+{
+    free(receiver->packet);
+    free(receiver->block);
+    fclose(receiver->file);
+    if (!complete)
+    {
+        return -1;
+    }
+
+    if (receiver->fileSize >= 0 && receiver->bytesReceived != receiver->fileSize)
+    {
+        printf("File size mismatch: expected %ld bytes, received %ld\n", receiver->fileSize,
+               receiver->bytesReceived);
+        return -1;
+    }
+
+    printf("File received: %ld bytes\n", receiver->bytesReceived);
+    return 0;
+}
+
+// Append "size" bytes to the file. Return "0" on success or "-1" on error.
+static int writeData(FileReceiver *receiver, const unsigned char *data, int size)
+{
+    if (fwrite(data, 1, size, receiver->file) != (size_t) size)
+    {
+        perror(receiver->name);
+        return -1;
+    }
+    receiver->bytesReceived += size;
+    return 0;
+}
+
+// Handle "packet", of "packetSize" bytes, received for the file.
+// Return "1" if more follow, "0" once the end packet arrived or "-1" on error.
+static int handlePacket(FileReceiver *receiver, const unsigned char *packet, int packetSize)
+{
+    if (packetSize == 0)
+    {
+        return 1;
+    }
+
+    switch (packet[0])
+    {
+    case C_START:
+    {
+        char remoteName[MAX_FILE_NAME + 1];
+        if (parseControlPacket(packet, packetSize, &receiver->fileSize, remoteName, &receiver->compression) < 0)
+        {
+            printf("Malformed start packet\n");
+            break;
+        }
+        if (receiver->compression != 0 && receiver->compression != COMPRESSION_LZ4)
+        {
+            printf("Unknown compression %d in start packet\n", receiver->compression);
+            break;
+        }
+        printf("Receiving %s (%ld bytes%s)\n", remoteName, receiver->fileSize,
+               receiver->compression != 0 ? ", compressed" : "");
+        receiver->started = TRUE;
+        break;
+    }
+
+    case C_DATA:
+    {
+        int dataSize = (packet[1] << 8) | packet[2];
+        if (!receiver->started || dataSize != packetSize - DATA_HEADER_SIZE)
+        {
+            printf("Unexpected data packet, ignoring\n");
+            break;
+        }
+        return writeData(receiver, packet + DATA_HEADER_SIZE, dataSize) < 0 ? -1 : 1;
+    }
+
+    case C_DATA_COMPRESSED:
+    {
+        int compressedSize = (packet[1] << 8) | packet[2];
+        if (!receiver->started || receiver->compression == 0 || packetSize < COMPRESSED_HEADER_SIZE ||
+            compressedSize != packetSize - COMPRESSED_HEADER_SIZE)
+        {
+            printf("Unexpected compressed data packet, ignoring\n");
+            break;
+        }
+        int dataSize = (packet[3] << 8) | packet[4];
+        if (dataSize > receiver->maxPacketSize ||
+            decompressBlock(packet + COMPRESSED_HEADER_SIZE, compressedSize, receiver->block, dataSize) != dataSize)
+        {
+            printf("Malformed compressed data packet, ignoring\n");
+            break;
+        }
+        return writeData(receiver, receiver->block, dataSize) < 0 ? -1 : 1;
+    }
+
+    case C_END:
+        return 0;
+
+    default:
+        printf("Unknown packet type %d, ignoring\n", packet[0]);
+        break;
+    }
+
+    return 1;
+}
+
+// Receive and handle the next packet.
+// Return "1" if more follow, "0" once the end packet arrived or "-1" on error.
+static int receiveNextPacket(FileReceiver *receiver)
+{
+    int packetSize = llreadjumbo(receiver->packet, receiver->maxPacketSize);
+    if (packetSize < 0)
+    {
+        printf("Connection lost after %ld bytes\n", receiver->bytesReceived);
+        return -1;
+    }
+    return handlePacket(receiver, receiver->packet, packetSize);
+}
+
+// Packets are submitted "depth" at a time, so reading and compressing the
+// next one overlaps with sending the others.
+static int sendFile(const char *filename, int compression, int depth)
+{
+    FileSender sender;
+    if (openSender(&sender, filename, compression, depth) < 0)
+    {
+        return -1;
+    }
+
+    int res;
+    while ((res = sendNextPacket(&sender)) > 0)
+    {
+    }
+    closeSender(&sender);
+    return res;
+}
+
+static int receiveFile(const char *filename)
+{
+    FileReceiver receiver;
+    if (openReceiver(&receiver, filename) < 0)
+    {
+        return -1;
+    }
+
+    int res;
+    while ((res = receiveNextPacket(&receiver)) > 0)
+    {
+    }
+    return closeReceiver(&receiver, res == 0);
+}
+
+// Full duplex: send "sendName" while receiving the peer's file into
+// "receiveName". Each end alternates one packet out and one packet in, so
+// neither writes far ahead of what the other reads, until one of the files is
+// done.
+static int exchangeFiles(const char *sendName, const char *receiveName, int compression)
+{
+    FileSender sender;
+    FileReceiver receiver;
+    if (openSender(&sender, sendName, compression, 1) < 0)
+    {
+        return -1;
+    }
+    if (openReceiver(&receiver, receiveName) < 0)
+    {
+        closeSender(&sender);
+        return -1;
+    }
+
+    int sending = TRUE;
+    int receiving = TRUE;
+    int res = 0;
+    while ((sending || receiving) && res >= 0)
+    {
+        if (sending)
+        {
+            res = sendNextPacket(&sender);
+            sending = res > 0;
+        }
+        if (receiving && res >= 0)
+        {
+            res = receiveNextPacket(&receiver);
+            receiving = res > 0;
+        }
+    }
+
+    closeSender(&sender);
+    if (closeReceiver(&receiver, res == 0) < 0)
+    {
+        return -1;
+    }
+    return res;
+}
+
+// Logical channels: send "names[0]" on channel 0 and "names[1]" on channel 1
+// at once. Each channel's queue is kept full, so that the scheduler and its
+// weights, not the order the packets are made in, share the line.
+static int sendOnChannels(const char *names[2], int compression)
+{
+    int weights[2];
+    loadChannelWeights(weights);
+    if (chopen() < 0 || chsetweight(0, weights[0]) < 0 || chsetweight(1, weights[1]) < 0)
+    {
+        printf("Could not set up the logical channels\n");
+        chclose();
+        return -1;
+    }
+
+    FileSender senders[2];
+    if (openSender(&senders[0], names[0], compression, 1) < 0)
+    {
+        chclose();
+        return -1;
+    }
+    if (openSender(&senders[1], names[1], compression, 1) < 0)
+    {
+        closeSender(&senders[0]);
+        chclose();
+        return -1;
+    }
+
+    // Data packets of one fragment each
+    for (int i = 0; i < 2; i++)
+    {
+        senders[i].channel = i;
+        if (senders[i].dataPacketSize > CH_MAX_FRAGMENT)
+        {
+            senders[i].dataPacketSize = CH_MAX_FRAGMENT;
+        }
+    }
+
+    int sending[2] = {TRUE, TRUE};
+    int res = 0;
+    while ((sending[0] || sending[1]) && res >= 0)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            while (sending[i] && res >= 0 && chqueued(i) < CH_QUEUE_SIZE)
+            {
+                res = sendNextPacket(&senders[i]);
+                sending[i] = res > 0;
+            }
+        }
+        if (res >= 0 && chsend() < 0)
+        {
+            res = -1;
+        }
+    }
+
+    if (chclose() < 0)
+    {
+        res = -1;
+    }
+    closeSender(&senders[0]);
+    closeSender(&senders[1]);
+    return res;
+}
+
+// Logical channels: receive channel 0 into "names[0]" and channel 1 into
+// "names[1]", in whatever order their packets come.
+static int receiveOnChannels(const char *names[2])
+{
+    if (chopen() < 0)
+    {
+        printf("Could not set up the logical channels\n");
+        return -1;
+    }
+
+    FileReceiver receivers[2];
+    if (openReceiver(&receivers[0], names[0]) < 0)
+    {
+        chclose();
+        return -1;
+    }
+    if (openReceiver(&receivers[1], names[1]) < 0)
+    {
+        closeReceiver(&receivers[0], FALSE);
+        chclose();
+        return -1;
+    }
+
+    // Packets of both channels are read into channel 0's buffer
+    int receiving[2] = {TRUE, TRUE};
+    int res = 0;
+    while ((receiving[0] || receiving[1]) && res >= 0)
+    {
+        int channel;
+        int packetSize = chread(&channel, receivers[0].packet, receivers[0].maxPacketSize);
+        if (packetSize < 0)
+        {
+            printf("Connection lost after %ld + %ld bytes\n", receivers[0].bytesReceived,
+                   receivers[1].bytesReceived);
+            res = -1;
+        }
+        else if (channel > 1 || !receiving[channel])
+        {
+            printf("Unexpected packet on channel %d, ignoring\n", channel);
+        }
+        else
+        {
+            res = handlePacket(&receivers[channel], receivers[0].packet, packetSize);
+            receiving[channel] = res > 0;
+            if (res == 0)
+            {
+                printf("Channel %d done after %ld bytes of channel %d\n", channel,
+                       receivers[!channel].bytesReceived, !channel);
+            }
+        }
+    }
+
+    chclose();
+    int failed = closeReceiver(&receivers[0], !receiving[0]) < 0;
+    failed |= closeReceiver(&receivers[1], !receiving[1]) < 0;
+    return failed ? -1 : res;
+}
 
 void applicationLayer(const char *serialPort, const char *role, int baudRate,
                       int nTries, int timeout, const char *filename)
 {
-    // TODO
+    LinkLayer connectionParameters;
+    memset(&connectionParameters, 0, sizeof(connectionParameters));
+    strncpy(connectionParameters.serialPort, serialPort, sizeof(connectionParameters.serialPort) - 1);
+    connectionParameters.role = strcmp(role, "tx") == 0 ? LlTx : LlRx;
+    connectionParameters.baudRate = baudRate;
+    connectionParameters.nRetransmissions = nTries;
+    connectionParameters.timeout = timeout;
+
+    const char *baud = getenv("LL_BAUD");
+    if (baud != NULL)
+    {
+        connectionParameters.baudRate = atoi(baud);
+    }
+
+    LinkLayerOptions options;
+    loadLinkOptions(&options);
+    if (llsetoptions(&options) < 0)
+    {
+        printf("Invalid link layer options\n");
+        return;
+    }
+
+    if (strcmp(role, "tx") != 0 && strcmp(role, "rx") != 0)
+    {
+        printf("Unknown role %s, must be tx or rx\n", role);
+        return;
+    }
+
+    if (llopen(connectionParameters) < 0)
+    {
+        printf("Could not open the connection\n");
+        return;
+    }
+
+    const char *exchange = getenv("APP_EXCHANGE");
+    if (exchange != NULL && llfullduplex() != TRUE)
+    {
+        printf("Full duplex was not agreed, not exchanging files\n");
+        exchange = NULL;
+    }
+
+    const char *channelFile = getenv("APP_CHANNEL_FILE");
+    if (channelFile != NULL && llchannels() < 2)
+    {
+        printf("Logical channels were not agreed, not sending %s\n", channelFile);
+        channelFile = NULL;
+    }
+
+    if (exchange != NULL)
+    {
+        // The transmitter sends its file and receives into "exchange", the receiver the other way round
+        if (connectionParameters.role == LlTx)
+        {
+            exchangeFiles(filename, exchange, loadCompression());
+        }
+        else
+        {
+            exchangeFiles(exchange, filename, loadCompression());
+        }
+    }
+    else if (channelFile != NULL)
+    {
+        const char *names[2] = {filename, channelFile};
+        if (connectionParameters.role == LlTx)
+        {
+            sendOnChannels(names, loadCompression());
+        }
+        else
+        {
+            receiveOnChannels(names);
+        }
+    }
+    else if (connectionParameters.role == LlTx)
+    {
+        sendFile(filename, loadCompression(), sendDepth(options.windowSize));
+    }
+    else
+    {
+        receiveFile(filename);
+    }
+
+    llclose(TRUE);
+    saveStatistics();
 }
@@ -0,0 +1,305 @@
+// Logical channels multiplexed over the link layer.
+// Each channel queues whole messages; the scheduler takes one fragment at a
+// time from the channel whose turn it is. On its turn a channel gets a credit
+// of weight times the largest fragment and sends fragments while they fit in it,
+// so every channel with messages queued sends at least one fragment per round
+// and the line is shared in proportion to the weights. The receiver keeps one
+// message being reassembled per channel.
+
+#include "channel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+    unsigned char *data;
+    int capacity;
+    int size;
+} QueuedMessage;
+
+typedef struct
+{
+    int weight;
+    int deficit; // Bytes the channel may still send in its turn
+    QueuedMessage queue[CH_QUEUE_SIZE];
+    int head;
+    int count;
+    int sent; // Bytes of the message at "head" already sent
+
+    unsigned char *assembly; // Message being received, CH_MAX_MESSAGE bytes
+    int assembled;
+    int overflow; // TRUE if the message being received is too large and dropped
+} Channel;
+
+static struct
+{
+    int channels; // 0 while closed
+    int multiplexed; // FALSE if no channels were agreed: messages go as they are
+    int messageLimit;
+    int fragmentLimit; // Largest fragment payload, also the credit of a weight of 1
+    Channel channel[LL_MAX_CHANNELS];
+    int current; // Channel whose turn it is
+    int turnStarted; // TRUE once "current" got its credit for this turn
+    unsigned char *fragment; // Header and payload of a fragment
+} ch;
+
+static void freeChannels(void)
+{
+    for (int i = 0; i < LL_MAX_CHANNELS; i++)
+    {
+        for (int j = 0; j < CH_QUEUE_SIZE; j++)
+        {
+            free(ch.channel[i].queue[j].data);
+        }
+        free(ch.channel[i].assembly);
+    }
+    free(ch.fragment);
+    memset(&ch, 0, sizeof(ch));
+}
+
+int chopen(void)
+{
+    int channels = llchannels();
+    if (channels < 0 || ch.channels > 0)
+    {
+        return -1;
+    }
+
+    memset(&ch, 0, sizeof(ch));
+    ch.channels = channels;
+    ch.multiplexed = channels > 1;
+    ch.messageLimit = ch.multiplexed ? CH_MAX_MESSAGE : llmaxpayload();
+    ch.fragmentLimit = ch.multiplexed ? CH_MAX_FRAGMENT : ch.messageLimit;
+
+    // Queued messages are allocated as they come, reassembly buffers up front
+    ch.fragment = malloc(CH_HEADER_SIZE + ch.fragmentLimit);
+    int failed = ch.fragment == NULL;
+    for (int i = 0; i < channels; i++)
+    {
+        ch.channel[i].weight = 1;
+        if (ch.multiplexed)
+        {
+            ch.channel[i].assembly = malloc(CH_MAX_MESSAGE);
+            failed |= ch.channel[i].assembly == NULL;
+        }
+    }
+    if (failed)
+    {
+        printf("Out of memory for %d channels\n", channels);
+        freeChannels();
+        return -1;
+    }
+    return channels;
+}
+
+int chsetweight(int channel, int weight)
+{
+    if (channel < 0 || channel >= ch.channels || weight < 1 || weight > 255)
+    {
+        return -1;
+    }
+    ch.channel[channel].weight = weight;
+    return 1;
+}
+
+// Size of the next fragment of "channel", which has a message queued.
+static int fragmentSize(const Channel *channel)
+{
+    int left = channel->queue[channel->head].size - channel->sent;
+    return left < ch.fragmentLimit ? left : ch.fragmentLimit;
+}
+
+// Channel that sends the next fragment, or "-1" if nothing is queued.
+static int scheduleChannel(void)
+{
+    // Two passes: the first may only end turns and hand out credit
+    for (int visited = 0; visited <= 2 * ch.channels; visited++)
+    {
+        Channel *channel = &ch.channel[ch.current];
+        if (channel->count > 0 && !ch.turnStarted)
+        {
+            channel->deficit += channel->weight * ch.fragmentLimit;
+            ch.turnStarted = TRUE;
+        }
+        if (channel->count > 0 && fragmentSize(channel) <= channel->deficit)
+        {
+            return ch.current;
+        }
+
+        // A channel with nothing queued keeps no credit for later
+        if (channel->count == 0)
+        {
+            channel->deficit = 0;
+        }
+        ch.current = (ch.current + 1) % ch.channels;
+        ch.turnStarted = FALSE;
+    }
+    return -1;
+}
+
+int chsend(void)
+{
+    int number = scheduleChannel();
+    if (number < 0)
+    {
+        return 0;
+    }
+
+    Channel *channel = &ch.channel[number];
+    QueuedMessage *message = &channel->queue[channel->head];
+    int size = fragmentSize(channel);
+    int res;
+    if (ch.multiplexed)
+    {
+        int last = channel->sent + size == message->size;
+        ch.fragment[0] = number | (last ? CH_LAST : 0);
+        memcpy(ch.fragment + CH_HEADER_SIZE, message->data + channel->sent, size);
+        res = llwritejumbo(ch.fragment, CH_HEADER_SIZE + size);
+    }
+    else
+    {
+        res = llwritejumbo(message->data, size);
+    }
+    if (res < 0)
+    {
+        printf("Failed to send a fragment on channel %d\n", number);
+        return -1;
+    }
+
+    channel->deficit -= size;
+    channel->sent += size;
+    if (channel->sent == message->size)
+    {
+        channel->head = (channel->head + 1) % CH_QUEUE_SIZE;
+        channel->count--;
+        channel->sent = 0;
+    }
+    return 1;
+}
+
+int chwrite(int channel, const unsigned char *buf, int bufSize)
+{
+    if (channel < 0 || channel >= ch.channels || buf == NULL || bufSize <= 0 || bufSize > ch.messageLimit)
+    {
+        return -1;
+    }
+
+    Channel *queued = &ch.channel[channel];
+    while (queued->count == CH_QUEUE_SIZE)
+    {
+        if (chsend() < 0)
+        {
+            return -1;
+        }
+    }
+
+    // Slots keep their buffer, grown to the largest message they held
+    QueuedMessage *message = &queued->queue[(queued->head + queued->count) % CH_QUEUE_SIZE];
+    if (message->capacity < bufSize)
+    {
+        unsigned char *data = realloc(message->data, bufSize);
+        if (data == NULL)
+        {
+            printf("Out of memory for a %d-byte message\n", bufSize);
+            return -1;
+        }
+        message->data = data;
+        message->capacity = bufSize;
+    }
+    memcpy(message->data, buf, bufSize);
+    message->size = bufSize;
+    queued->count++;
+    return bufSize;
+}
+
+int chqueued(int channel)
+{
+    return channel < 0 || channel >= ch.channels ? -1 : ch.channel[channel].count;
+}
+
+int chflush(void)
+{
+    if (ch.channels == 0)
+    {
+        return -1;
+    }
+
+    int res;
+    while ((res = chsend()) > 0)
+    {
+    }
+    return res < 0 ? -1 : 1;
+}
+
+int chread(int *channel, unsigned char *packet, int packetSize)
+{
+    if (ch.channels == 0 || channel == NULL || packet == NULL)
+    {
+        return -1;
+    }
+
+    if (!ch.multiplexed)
+    {
+        *channel = 0;
+        return llreadjumbo(packet, packetSize);
+    }
+
+    while (TRUE)
+    {
+        int size = llreadjumbo(ch.fragment, CH_HEADER_SIZE + ch.fragmentLimit);
+        if (size < 0)
+        {
+            return -1;
+        }
+        int number = size >= CH_HEADER_SIZE ? ch.fragment[0] & ~CH_LAST : -1;
+        if (number < 0 || number >= ch.channels)
+        {
+            printf("Fragment for unknown channel %d, ignoring\n", number);
+            continue;
+        }
+
+        Channel *receiving = &ch.channel[number];
+        int dataSize = size - CH_HEADER_SIZE;
+        if (receiving->assembled + dataSize > CH_MAX_MESSAGE)
+        {
+            receiving->overflow = TRUE;
+        }
+        else
+        {
+            memcpy(receiving->assembly + receiving->assembled, ch.fragment + CH_HEADER_SIZE, dataSize);
+            receiving->assembled += dataSize;
+        }
+        if (!(ch.fragment[0] & CH_LAST))
+        {
+            continue;
+        }
+
+        int messageSize = receiving->assembled;
+        int dropped = receiving->overflow || messageSize > packetSize;
+        receiving->assembled = 0;
+        receiving->overflow = FALSE;
+        if (dropped)
+        {
+            printf("Message on channel %d does not fit in %d bytes, ignoring\n", number, packetSize);
+            continue;
+        }
+
+        memcpy(packet, receiving->assembly, messageSize);
+        *channel = number;
+        return messageSize;
+    }
+}
+
+int chclose(void)
+{
+    if (ch.channels == 0)
+    {
+        return -1;
+    }
+
+    int res = chflush();
+    freeChannels();
+    return res;
+}
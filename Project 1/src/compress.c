@@ -0,0 +1,244 @@
+// LZ4 block format compressor and decompressor.
+// The compressor finds matches through a hash table of the last position of
+// each 4-byte sequence and takes the first one found (greedy parsing). While
+// no match turns up it looks at fewer and fewer positions, so that data that
+// does not compress, like a GIF, costs little time before it is sent as is.
+
+#include "compress.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+
+// The format requires the last 5 bytes to be literals and the last match to
+// start at least 12 bytes before the end of the block
+#define LAST_LITERALS 5
+#define MATCH_FIND_LIMIT 12
+
+#define HASH_LOG 12
+
+// Positions looked at without a match before the step grows by one
+#define SKIP_TRIGGER 6
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static int hash(uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - HASH_LOG);
+}
+
+// Write a length above the 15 that fits in the token as extra bytes.
+// Return the new output position or "-1" if it does not fit.
+static int writeLength(unsigned char *out, int op, int outSpace, int length)
+{
+    while (length >= 255)
+    {
+        if (op >= outSpace)
+        {
+            return -1;
+        }
+        out[op++] = 255;
+        length -= 255;
+    }
+    if (op >= outSpace)
+    {
+        return -1;
+    }
+    out[op++] = length;
+    return op;
+}
+
+// Write a sequence: "literalCount" literals and, unless "matchLength" is zero
+// (last sequence), a match. Return the new output position or "-1" if full.
+static int writeSequence(unsigned char *out, int op, int outSpace, const unsigned char *literals,
+                         int literalCount, int offset, int matchLength)
+{
+    if (op >= outSpace)
+    {
+        return -1;
+    }
+
+    int token = op++;
+    int matchCode = matchLength > 0 ? matchLength - MIN_MATCH : 0;
+    out[token] = ((literalCount < 15 ? literalCount : 15) << 4) | (matchCode < 15 ? matchCode : 15);
+
+    if (literalCount >= 15 && (op = writeLength(out, op, outSpace, literalCount - 15)) < 0)
+    {
+        return -1;
+    }
+    if (op + literalCount > outSpace)
+    {
+        return -1;
+    }
+    memcpy(out + op, literals, literalCount);
+    op += literalCount;
+
+    if (matchLength == 0)
+    {
+        return op;
+    }
+
+    if (op + 2 > outSpace)
+    {
+        return -1;
+    }
+    out[op++] = offset & 0xFF;
+    out[op++] = offset >> 8;
+
+    if (matchCode >= 15)
+    {
+        op = writeLength(out, op, outSpace, matchCode - 15);
+    }
+    return op;
+}
+
+int compressBlock(const unsigned char *in, int size, unsigned char *out, int outSpace)
+{
+    // Blocks are at most a packet, below 64 KiB, so positions fit in 16 bits
+    // and the table is cheap to clear for every block
+    uint16_t table[1 << HASH_LOG];
+    memset(table, 0, sizeof(table));
+
+    int anchor = 0;
+    int op = 0;
+    int matchLimit = size - LAST_LITERALS;
+    int findLimit = size - MATCH_FIND_LIMIT;
+    int ip = 1;
+    int attempts = 0;
+
+    while (ip < findLimit)
+    {
+        uint32_t sequence = read32(in + ip);
+        int h = hash(sequence);
+        int ref = table[h];
+        table[h] = ip;
+
+        if (ip - ref > MAX_OFFSET || read32(in + ref) != sequence || ref >= ip)
+        {
+            ip += 1 + (attempts++ >> SKIP_TRIGGER);
+            continue;
+        }
+        attempts = 0;
+
+        // Extend the match backwards over pending literals, then forwards
+        while (ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1])
+        {
+            ip--;
+            ref--;
+        }
+        int length = MIN_MATCH;
+        while (ip + length < matchLimit && in[ref + length] == in[ip + length])
+        {
+            length++;
+        }
+
+        op = writeSequence(out, op, outSpace, in + anchor, ip - anchor, ip - ref, length);
+        if (op < 0)
+        {
+            return -1;
+        }
+
+        ip += length;
+        anchor = ip;
+        if (ip - 2 > 0 && ip - 2 < findLimit)
+        {
+            table[hash(read32(in + ip - 2))] = ip - 2;
+        }
+    }
+
+    return writeSequence(out, op, outSpace, in + anchor, size - anchor, 0, 0);
+}
+
+int decompressBlock(const unsigned char *in, int size, unsigned char *out, int outSpace)
+{
+    int ip = 0;
+    int op = 0;
+
+    while (ip < size)
+    {
+        int token = in[ip++];
+
+        int literalCount = token >> 4;
+        if (literalCount == 15)
+        {
+            int extra;
+            do
+            {
+                if (ip >= size)
+                {
+                    return -1;
+                }
+                extra = in[ip++];
+                literalCount += extra;
+            } while (extra == 255);
+        }
+        if (literalCount > size - ip || literalCount > outSpace - op)
+        {
+            return -1;
+        }
+        memcpy(out + op, in + ip, literalCount);
+        ip += literalCount;
+        op += literalCount;
+
+        // The last sequence has no match
+        if (ip == size)
+        {
+            break;
+        }
+
+        if (ip + 2 > size)
+        {
+            return -1;
+        }
+        int offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op)
+        {
+            return -1;
+        }
+
+        int length = token & 0x0F;
+        if (length == 15)
+        {
+            int extra;
+            do
+            {
+                if (ip >= size)
+                {
+                    return -1;
+                }
+                extra = in[ip++];
+                length += extra;
+            } while (extra == 255);
+        }
+        length += MIN_MATCH;
+        if (length > outSpace - op)
+        {
+            return -1;
+        }
+
+        // Matches may overlap their own output (runs), so copy forwards
+        const unsigned char *match = out + op - offset;
+        if (offset >= length)
+        {
+            memcpy(out + op, match, length);
+        }
+        else
+        {
+            for (int i = 0; i < length; i++)
+            {
+                out[op + i] = match[i];
+            }
+        }
+        op += length;
+    }
+
+    return op;
+}
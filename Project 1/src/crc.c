@@ -0,0 +1,215 @@
+// Cyclic redundancy checks: slicing-by-8 tables and PCLMULQDQ folding.
+
+#include "crc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC_HAVE_X86 1
+#endif
+
+#define CRC16_POLY_REFLECTED 0x8408
+#define CRC32_POLY_REFLECTED 0xEDB88320
+
+// Table k maps a byte to its contribution after k more bytes were processed,
+// so eight bytes are folded with eight independent lookups.
+static uint16_t crc16Table[8][256];
+static uint32_t crc32Table[8][256];
+static int tablesReady = 0;
+
+static void buildTables(void)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        uint16_t c16 = i;
+        uint32_t c32 = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            c16 = (c16 & 1) ? (c16 >> 1) ^ CRC16_POLY_REFLECTED : c16 >> 1;
+            c32 = (c32 & 1) ? (c32 >> 1) ^ CRC32_POLY_REFLECTED : c32 >> 1;
+        }
+        crc16Table[0][i] = c16;
+        crc32Table[0][i] = c32;
+    }
+
+    for (int k = 1; k < 8; k++)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            uint16_t c16 = crc16Table[k - 1][i];
+            uint32_t c32 = crc32Table[k - 1][i];
+            crc16Table[k][i] = (c16 >> 8) ^ crc16Table[0][c16 & 0xFF];
+            crc32Table[k][i] = (c32 >> 8) ^ crc32Table[0][c32 & 0xFF];
+        }
+    }
+
+    tablesReady = 1;
+}
+
+uint16_t crc16Update(uint16_t crc, const unsigned char *buf, size_t size)
+{
+    if (!tablesReady)
+    {
+        buildTables();
+    }
+
+    while (size >= 8)
+    {
+        crc = crc16Table[7][buf[0] ^ (crc & 0xFF)] ^ crc16Table[6][buf[1] ^ (crc >> 8)] ^
+              crc16Table[5][buf[2]] ^ crc16Table[4][buf[3]] ^
+              crc16Table[3][buf[4]] ^ crc16Table[2][buf[5]] ^
+              crc16Table[1][buf[6]] ^ crc16Table[0][buf[7]];
+        buf += 8;
+        size -= 8;
+    }
+
+    while (size-- > 0)
+    {
+        crc = (crc >> 8) ^ crc16Table[0][(crc ^ *buf++) & 0xFF];
+    }
+
+    return crc;
+}
+
+uint32_t crc32UpdatePortable(uint32_t crc, const unsigned char *buf, size_t size)
+{
+    if (!tablesReady)
+    {
+        buildTables();
+    }
+
+    while (size >= 8)
+    {
+        uint32_t low = crc ^ (buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t) buf[3] << 24));
+        crc = crc32Table[7][low & 0xFF] ^ crc32Table[6][(low >> 8) & 0xFF] ^
+              crc32Table[5][(low >> 16) & 0xFF] ^ crc32Table[4][low >> 24] ^
+              crc32Table[3][buf[4]] ^ crc32Table[2][buf[5]] ^
+              crc32Table[1][buf[6]] ^ crc32Table[0][buf[7]];
+        buf += 8;
+        size -= 8;
+    }
+
+    while (size-- > 0)
+    {
+        crc = (crc >> 8) ^ crc32Table[0][(crc ^ *buf++) & 0xFF];
+    }
+
+    return crc;
+}
+
+#ifdef CRC_HAVE_X86
+// Fold 64-byte blocks with carry-less multiplication and Barrett-reduce the
+// remainder ("Fast CRC Computation for Generic Polynomials Using PCLMULQDQ",
+// Intel, 2009). "size" must be a multiple of 16 and at least 64.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32Pclmul(uint32_t crc, const unsigned char *buf, size_t size)
+{
+    // Bit-reflected folding constants x^(k) mod P(x) and the Barrett constants
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = {0x0154442bd4, 0x01c6e41596};
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = {0x01751997d0, 0x00ccaa009e};
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = {0x0163cd6124, 0x0000000000};
+    static const uint64_t poly[2] __attribute__((aligned(16))) = {0x01db710641, 0x01f7011641};
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i *) k1k2);
+    buf += 64;
+    size -= 64;
+
+    // Four independent 128-bit lanes, 64 bytes per iteration
+    while (size >= 64)
+    {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        size -= 64;
+    }
+
+    // Fold the four lanes into one
+    x0 = _mm_load_si128((const __m128i *) k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Remaining 16-byte blocks
+    while (size >= 16)
+    {
+        x2 = _mm_loadu_si128((const __m128i *) buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        size -= 16;
+    }
+
+    // 128 bits down to 64
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *) k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i *) poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_extract_epi32(x1, 1);
+}
+
+static int hasPclmul(void)
+{
+    static int cached = -1;
+    if (cached < 0)
+    {
+        __builtin_cpu_init();
+        cached = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+    }
+    return cached;
+}
+#endif
+
+uint32_t crc32Update(uint32_t crc, const unsigned char *buf, size_t size)
+{
+#ifdef CRC_HAVE_X86
+    if (size >= 64 && hasPclmul())
+    {
+        size_t folded = size & ~(size_t) 15;
+        crc = crc32Pclmul(crc, buf, folded);
+        buf += folded;
+        size -= folded;
+    }
+#endif
+    return crc32UpdatePortable(crc, buf, size);
+}
@@ -0,0 +1,605 @@
+// Reed-Solomon RS(255,223) over GF(256) with the primitive polynomial 0x11D.
+// The generator has the roots alpha^0..alpha^31. Encoding and the error-free
+// check run a table-driven LFSR; syndromes and the Chien search of the decoder
+// are GF(256) multiply-accumulates of whole regions, with SIMD kernels.
+
+#include "fec.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FEC_HAVE_X86 1
+#endif
+
+#define GF_POLY 0x11D
+#define FEC_T (FEC_PARITY / 2)
+
+static unsigned char gfExp[2 * FEC_CODEWORD];
+static unsigned char gfLog[256];
+
+// Products of every byte with the low nibbles (first 16 entries) and the high
+// nibbles (last 16) of c, the two PSHUFB lookup tables of a multiplication by c
+static unsigned char nibbleTable[256][32] __attribute__((aligned(32)));
+
+// genTable[f] is f times the generator coefficients, in parity byte order and
+// packed in 64-bit words, so that an LFSR step is four shifts and XORs
+static uint64_t genTable[256][FEC_PARITY / 8];
+
+// syndromeTable[t][j] = alpha^(j * (31 - t)): weight of parity byte t in syndrome j
+static unsigned char syndromeTable[FEC_PARITY][FEC_PARITY];
+
+// chienTable[k][i] = alpha^(-i * k): term k of the error locator at position i
+static unsigned char chienTable[FEC_T + 1][256];
+
+static int tablesReady = 0;
+
+static unsigned char gfMul(unsigned char a, unsigned char b)
+{
+    if (a == 0 || b == 0)
+    {
+        return 0;
+    }
+    return gfExp[gfLog[a] + gfLog[b]];
+}
+
+static unsigned char gfDiv(unsigned char a, unsigned char b)
+{
+    if (a == 0)
+    {
+        return 0;
+    }
+    return gfExp[gfLog[a] + FEC_CODEWORD - gfLog[b]];
+}
+
+static unsigned char gfPow(int exponent)
+{
+    exponent %= FEC_CODEWORD;
+    if (exponent < 0)
+    {
+        exponent += FEC_CODEWORD;
+    }
+    return gfExp[exponent];
+}
+
+static void buildTables(void)
+{
+    int x = 1;
+    for (int i = 0; i < FEC_CODEWORD; i++)
+    {
+        gfExp[i] = x;
+        gfExp[i + FEC_CODEWORD] = x;
+        gfLog[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+        {
+            x ^= GF_POLY;
+        }
+    }
+
+    for (int c = 0; c < 256; c++)
+    {
+        for (int n = 0; n < 16; n++)
+        {
+            nibbleTable[c][n] = gfMul(c, n);
+            nibbleTable[c][16 + n] = gfMul(c, n << 4);
+        }
+    }
+
+    // g(x) = (x - alpha^0) ... (x - alpha^31), coefficient of x^k in generator[k]
+    unsigned char generator[FEC_PARITY + 1] = {1};
+    for (int j = 0; j < FEC_PARITY; j++)
+    {
+        for (int k = j + 1; k > 0; k--)
+        {
+            generator[k] = generator[k - 1] ^ gfMul(generator[k], gfExp[j]);
+        }
+        generator[0] = gfMul(generator[0], gfExp[j]);
+    }
+
+    for (int f = 0; f < 256; f++)
+    {
+        memset(genTable[f], 0, sizeof(genTable[f]));
+        for (int t = 0; t < FEC_PARITY; t++)
+        {
+            uint64_t product = gfMul(f, generator[FEC_PARITY - 1 - t]);
+            genTable[f][t / 8] |= product << (8 * (t % 8));
+        }
+    }
+
+    for (int t = 0; t < FEC_PARITY; t++)
+    {
+        for (int j = 0; j < FEC_PARITY; j++)
+        {
+            syndromeTable[t][j] = gfPow(j * (FEC_PARITY - 1 - t));
+        }
+    }
+
+    for (int k = 0; k <= FEC_T; k++)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            chienTable[k][i] = gfPow(-i * k);
+        }
+    }
+
+    tablesReady = 1;
+}
+
+static void gfMulAddScalar(unsigned char *dst, const unsigned char *src, unsigned char c, size_t size)
+{
+    const unsigned char *table = nibbleTable[c];
+    for (size_t i = 0; i < size; i++)
+    {
+        dst[i] ^= table[src[i] & 0x0F] ^ table[16 + (src[i] >> 4)];
+    }
+}
+
+#ifdef FEC_HAVE_X86
+__attribute__((target("ssse3")))
+static void gfMulAddSsse3(unsigned char *dst, const unsigned char *src, unsigned char c, size_t size)
+{
+    const __m128i low = _mm_load_si128((const __m128i *) nibbleTable[c]);
+    const __m128i high = _mm_load_si128((const __m128i *) (nibbleTable[c] + 16));
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    size_t i = 0;
+
+    while (i + 16 <= size)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i product = _mm_xor_si128(_mm_shuffle_epi8(low, _mm_and_si128(v, mask)),
+                                        _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi64(v, 4), mask)));
+        __m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(d, product));
+        i += 16;
+    }
+
+    gfMulAddScalar(dst + i, src + i, c, size - i);
+}
+
+__attribute__((target("avx2")))
+static void gfMulAddAvx2(unsigned char *dst, const unsigned char *src, unsigned char c, size_t size)
+{
+    const __m256i low = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) nibbleTable[c]));
+    const __m256i high = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) (nibbleTable[c] + 16)));
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    size_t i = 0;
+
+    while (i + 32 <= size)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+        __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(low, _mm256_and_si256(v, mask)),
+                                           _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi64(v, 4), mask)));
+        __m256i d = _mm256_loadu_si256((const __m256i *) (dst + i));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_xor_si256(d, product));
+        i += 32;
+    }
+
+    gfMulAddScalar(dst + i, src + i, c, size - i);
+}
+#endif
+
+typedef void (*MulAddFunction)(unsigned char *, const unsigned char *, unsigned char, size_t);
+
+static MulAddFunction mulAddFunction = NULL;
+
+static int kernelSupported(FecKernel kernel)
+{
+    switch (kernel)
+    {
+    case FecScalar:
+        return 1;
+#ifdef FEC_HAVE_X86
+    case FecSsse3:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("ssse3");
+    case FecAvx2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+FecKernel fecBestKernel(void)
+{
+    if (kernelSupported(FecAvx2))
+    {
+        return FecAvx2;
+    }
+    if (kernelSupported(FecSsse3))
+    {
+        return FecSsse3;
+    }
+    return FecScalar;
+}
+
+int fecSelectKernel(FecKernel kernel)
+{
+    if (!kernelSupported(kernel))
+    {
+        return -1;
+    }
+
+    switch (kernel)
+    {
+#ifdef FEC_HAVE_X86
+    case FecSsse3:
+        mulAddFunction = gfMulAddSsse3;
+        break;
+    case FecAvx2:
+        mulAddFunction = gfMulAddAvx2;
+        break;
+#endif
+    default:
+        mulAddFunction = gfMulAddScalar;
+        break;
+    }
+    return 1;
+}
+
+void gfMulAddRegion(unsigned char *dst, const unsigned char *src, unsigned char c, size_t size)
+{
+    if (!tablesReady)
+    {
+        buildTables();
+    }
+    if (mulAddFunction == NULL)
+    {
+        fecSelectKernel(fecBestKernel());
+    }
+    if (c != 0)
+    {
+        mulAddFunction(dst, src, c, size);
+    }
+}
+
+// One LFSR step of the parity register (w0..w3) for the message byte "byte".
+#define PARITY_STEP(w0, w1, w2, w3, byte)                           \
+    do                                                              \
+    {                                                               \
+        const uint64_t *g = genTable[(byte) ^ ((w0) & 0xFF)];       \
+        w0 = (((w0) >> 8) | ((w1) << 56)) ^ g[0];                   \
+        w1 = (((w1) >> 8) | ((w2) << 56)) ^ g[1];                   \
+        w2 = (((w2) >> 8) | ((w3) << 56)) ^ g[2];                   \
+        w3 = ((w3) >> 8) ^ g[3];                                    \
+    } while (0)
+
+static void storeParity(uint64_t w0, uint64_t w1, uint64_t w2, uint64_t w3, unsigned char *parity)
+{
+    uint64_t words[FEC_PARITY / 8] = {w0, w1, w2, w3};
+    for (int t = 0; t < FEC_PARITY; t++)
+    {
+        parity[t] = (words[t / 8] >> (8 * (t % 8))) & 0xFF;
+    }
+}
+
+// Parity of "size" message bytes: the remainder of m(x) * x^32 divided by g(x),
+// highest degree first. The register is kept as four little-endian words whose
+// byte 0 is the next feedback term.
+static void computeParity(const unsigned char *data, size_t size, unsigned char *parity)
+{
+    uint64_t w0 = 0, w1 = 0, w2 = 0, w3 = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        PARITY_STEP(w0, w1, w2, w3, data[i]);
+    }
+    storeParity(w0, w1, w2, w3, parity);
+}
+
+// Parity of two messages at once. Each step waits for the previous feedback
+// term, so interleaving two independent registers nearly doubles throughput.
+// "sizeB" may be one byte shorter than "sizeA".
+static void computeParityPair(const unsigned char *dataA, size_t sizeA, unsigned char *parityA,
+                              const unsigned char *dataB, size_t sizeB, unsigned char *parityB)
+{
+    uint64_t a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+    uint64_t b0 = 0, b1 = 0, b2 = 0, b3 = 0;
+    for (size_t i = 0; i < sizeB; i++)
+    {
+        PARITY_STEP(a0, a1, a2, a3, dataA[i]);
+        PARITY_STEP(b0, b1, b2, b3, dataB[i]);
+    }
+    if (sizeA > sizeB)
+    {
+        PARITY_STEP(a0, a1, a2, a3, dataA[sizeB]);
+    }
+    storeParity(a0, a1, a2, a3, parityA);
+    storeParity(b0, b1, b2, b3, parityB);
+}
+
+// Berlekamp-Massey: the shortest error locator "lambda" generating the
+// syndromes. Return its degree, the number of errors it locates.
+static int errorLocator(const unsigned char *syndromes, unsigned char *lambda)
+{
+    unsigned char previous[FEC_PARITY + 1] = {1};
+    unsigned char saved[FEC_PARITY + 1];
+    unsigned char previousDiscrepancy = 1;
+    int degree = 0;
+    int shift = 1;
+
+    memset(lambda, 0, FEC_PARITY + 1);
+    lambda[0] = 1;
+
+    for (int n = 0; n < FEC_PARITY; n++)
+    {
+        unsigned char discrepancy = syndromes[n];
+        for (int i = 1; i <= degree; i++)
+        {
+            discrepancy ^= gfMul(lambda[i], syndromes[n - i]);
+        }
+
+        if (discrepancy == 0)
+        {
+            shift++;
+            continue;
+        }
+
+        unsigned char scale = gfDiv(discrepancy, previousDiscrepancy);
+        memcpy(saved, lambda, sizeof(saved));
+        for (int i = 0; i + shift <= FEC_PARITY; i++)
+        {
+            lambda[i + shift] ^= gfMul(scale, previous[i]);
+        }
+
+        if (2 * degree <= n)
+        {
+            degree = n + 1 - degree;
+            memcpy(previous, saved, sizeof(previous));
+            previousDiscrepancy = discrepancy;
+            shift = 1;
+        }
+        else
+        {
+            shift++;
+        }
+    }
+
+    return degree;
+}
+
+// Correct one codeword of "size" bytes in place: message then parity, byte b
+// being the coefficient of x^(size - 1 - b). "remainder" holds the parity
+// computed from the received message.
+// Return the number of bytes corrected or "-1" if it cannot be corrected.
+static int decodeCodeword(unsigned char *codeword, int size, unsigned char *remainder)
+{
+    int dataSize = size - FEC_PARITY;
+
+    // Remainder of the received word: zero for a valid codeword
+    int clean = 1;
+    for (int t = 0; t < FEC_PARITY; t++)
+    {
+        remainder[t] ^= codeword[dataSize + t];
+        clean &= remainder[t] == 0;
+    }
+    if (clean)
+    {
+        return 0;
+    }
+
+    // The remainder evaluates to the same syndromes as the whole word
+    unsigned char syndromes[FEC_PARITY] = {0};
+    for (int t = 0; t < FEC_PARITY; t++)
+    {
+        mulAddFunction(syndromes, syndromeTable[t], remainder[t], FEC_PARITY);
+    }
+
+    unsigned char lambda[FEC_PARITY + 1];
+    int errors = errorLocator(syndromes, lambda);
+    if (errors > FEC_T)
+    {
+        return -1;
+    }
+
+    // Chien search: lambda(alpha^-i) for every position i at once
+    unsigned char values[256] = {0};
+    for (int k = 0; k <= errors; k++)
+    {
+        mulAddFunction(values, chienTable[k], lambda[k], size);
+    }
+
+    // Error evaluator omega(x) = S(x) * lambda(x) mod x^32
+    unsigned char omega[FEC_PARITY] = {0};
+    for (int j = 0; j < FEC_PARITY; j++)
+    {
+        for (int k = 0; k <= errors && k <= j; k++)
+        {
+            omega[j] ^= gfMul(syndromes[j - k], lambda[k]);
+        }
+    }
+
+    // Forney: the error at X = alpha^i is X * omega(1/X) / lambda'(1/X)
+    int found = 0;
+    for (int i = 0; i < size; i++)
+    {
+        if (values[i] != 0)
+        {
+            continue;
+        }
+
+        unsigned char inverse = gfPow(-i);
+        unsigned char numerator = 0;
+        unsigned char power = 1;
+        for (int j = 0; j < FEC_PARITY; j++)
+        {
+            numerator ^= gfMul(omega[j], power);
+            power = gfMul(power, inverse);
+        }
+
+        unsigned char denominator = 0;
+        unsigned char inverseSquared = gfMul(inverse, inverse);
+        power = 1;
+        for (int k = 1; k <= errors; k += 2)
+        {
+            denominator ^= gfMul(lambda[k], power);
+            power = gfMul(power, inverseSquared);
+        }
+        if (denominator == 0)
+        {
+            return -1;
+        }
+
+        codeword[size - 1 - i] ^= gfMul(gfPow(i), gfDiv(numerator, denominator));
+        found++;
+    }
+
+    // Roots outside the (shortened) codeword mean too many errors
+    return found == errors ? errors : -1;
+}
+
+// Codewords a message of "size" bytes is split into: enough to hold FEC_DATA
+// bytes each, and at least "depth" (one byte each at least) to interleave.
+static size_t codewordCount(size_t size, int depth)
+{
+    size_t codewords = FEC_CODEWORDS(size);
+    size_t minimum = (size_t) depth < size ? (size_t) depth : size;
+    return codewords > minimum ? codewords : minimum;
+}
+
+size_t fecEncodedSize(size_t size, int depth)
+{
+    return size + FEC_PARITY * codewordCount(size, depth);
+}
+
+// The encoded size grows with the message size, so a binary search finds it.
+long fecMessageSize(size_t encodedSize, int depth)
+{
+    size_t low = 0;
+    size_t high = encodedSize;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (fecEncodedSize(middle, depth) < encodedSize)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return fecEncodedSize(low, depth) == encodedSize ? (long) low : -1;
+}
+
+// Symbol j of codeword k is at j * codewords + k: the codewords of a field are
+// interleaved byte by byte, the longer ones first.
+static void scatter(const unsigned char *data, size_t dataSize, const unsigned char *parity, size_t k,
+                    size_t codewords, unsigned char *out)
+{
+    unsigned char *symbol = out + k;
+    for (size_t j = 0; j < dataSize; j++)
+    {
+        *symbol = data[j];
+        symbol += codewords;
+    }
+    for (int t = 0; t < FEC_PARITY; t++)
+    {
+        *symbol = parity[t];
+        symbol += codewords;
+    }
+}
+
+static void gather(const unsigned char *in, size_t k, size_t codewords, size_t size, unsigned char *codeword)
+{
+    const unsigned char *symbol = in + k;
+    for (size_t j = 0; j < size; j++)
+    {
+        codeword[j] = *symbol;
+        symbol += codewords;
+    }
+}
+
+size_t fecEncode(const unsigned char *in, size_t size, int depth, unsigned char *out)
+{
+    if (!tablesReady)
+    {
+        buildTables();
+    }
+
+    size_t codewords = codewordCount(size, depth);
+    unsigned char parity[2][FEC_PARITY];
+    for (size_t k = 0; k < codewords; k += 2)
+    {
+        // Each codeword takes the next run of the message, at most one byte
+        // apart in size from the others
+        size_t firstSize = size / codewords + (k < size % codewords);
+        if (k + 1 == codewords)
+        {
+            computeParity(in, firstSize, parity[0]);
+            scatter(in, firstSize, parity[0], k, codewords, out);
+            break;
+        }
+
+        size_t secondSize = size / codewords + (k + 1 < size % codewords);
+        computeParityPair(in, firstSize, parity[0], in + firstSize, secondSize, parity[1]);
+        scatter(in, firstSize, parity[0], k, codewords, out);
+        scatter(in + firstSize, secondSize, parity[1], k + 1, codewords, out);
+        in += firstSize + secondSize;
+    }
+    return size + FEC_PARITY * codewords;
+}
+
+int fecDecode(const unsigned char *in, size_t size, int depth, unsigned char *out, size_t *messageSize)
+{
+    if (!tablesReady)
+    {
+        buildTables();
+    }
+    if (mulAddFunction == NULL)
+    {
+        fecSelectKernel(fecBestKernel());
+    }
+
+    *messageSize = 0;
+    long message = fecMessageSize(size, depth);
+    if (message < 0)
+    {
+        return -1;
+    }
+
+    size_t codewords = codewordCount(message, depth);
+    unsigned char received[2][FEC_CODEWORD];
+    unsigned char remainders[2][FEC_PARITY];
+    size_t dataSizes[2];
+    int corrected = 0;
+    int failed = 0;
+
+    // Two codewords at a time, so that their remainders are computed together
+    for (size_t k = 0; k < codewords; k += 2)
+    {
+        int count = k + 1 < codewords ? 2 : 1;
+        for (int i = 0; i < count; i++)
+        {
+            dataSizes[i] = message / codewords + (k + i < message % codewords);
+            gather(in, k + i, codewords, dataSizes[i] + FEC_PARITY, received[i]);
+        }
+        if (count == 2)
+        {
+            computeParityPair(received[0], dataSizes[0], remainders[0], received[1], dataSizes[1], remainders[1]);
+        }
+        else
+        {
+            computeParity(received[0], dataSizes[0], remainders[0]);
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            int res = decodeCodeword(received[i], dataSizes[i] + FEC_PARITY, remainders[i]);
+            if (res < 0)
+            {
+                failed = 1;
+            }
+            else
+            {
+                corrected += res;
+            }
+            memcpy(out + *messageSize, received[i], dataSizes[i]);
+            *messageSize += dataSizes[i];
+        }
+    }
+
+    return failed ? -1 : corrected;
+}
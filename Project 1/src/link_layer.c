@@ -1,117 +1,2282 @@
 // Link layer protocol implementation
 
 #include "link_layer.h"
+#include "link_layer_ext.h"
+#include "crc.h"
+#include "fec.h"
+#include "statistics.h"
+#include "stuffing.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <termios.h>
 #include <string.h>
-#include <signal.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// Address field
+#define A_TX 0x03 // Commands sent by the transmitter, replies sent by the receiver
+#define A_RX 0x01 // Commands sent by the receiver, replies sent by the transmitter
+// In full duplex, the I-frames of the receiver are its commands: A_RX, and
+// the transmitter's RR/REJ/SREJ answering them are replies: A_RX too.
 
-// Definições das tramas
-#define FLAG 0x7E
-#define A 0x03  // Endereço
+// Control field, HDLC modulo-8 layout:
+//   I-frame: N(R) P N(S) 0    (bits 7-5, 4, 3-1, 0)
+//   S-frame: N(R) P type 01   (bits 7-5, 4, 3-2, 1-0)
+//   U-frame: xxx  P xx   11
 #define C_SET 0x03
-#define C_UA  0x07
-#define BCC_SET (A ^ C_SET)
-#define BCC_UA  (A ^ C_UA)
+#define C_UA 0x07
+#define C_DISC 0x0B
+#define C_I(ns) ((unsigned char) ((ns) << 1))
+#define C_MORE 0x10 // P/F bit of I-frames: more segments of the message follow (with segmentation)
+#define C_RR(nr) ((unsigned char) (0x01 | ((nr) << 5)))
+#define C_REJ(nr) ((unsigned char) (0x09 | ((nr) << 5)))
+#define C_SREJ(nr) ((unsigned char) (0x0D | ((nr) << 5)))
+
+#define IS_I_FRAME(c) (((c) & 0x01) == 0x00)
+#define HAS_PARAMETERS(c) ((c) == C_SET || (c) == C_UA) // May carry a parameter field
+#define IS_S_FRAME(c) (((c) & 0x03) == 0x01)
+#define S_TYPE(c) ((c) & 0x0F)
+#define S_RR 0x01
+#define S_REJ 0x09
+#define S_SREJ 0x0D
+#define C_NS(c) (((c) >> 1) & 0x07)
+#define C_NR(c) (((c) >> 5) & 0x07)
+#define C_WITH_NR(c, nr) ((unsigned char) (((c) & 0x1F) | ((nr) << 5))) // I-frame C carrying N(R)
+
+#define SEQ_PREV(n) (((n) + LL_SEQ_MODULO - 1) % LL_SEQ_MODULO)
+#define SEQ_NEXT(n) (((n) + 1) % LL_SEQ_MODULO)
+#define SEQ_DIST(from, to) (((to) - (from) + LL_SEQ_MODULO) % LL_SEQ_MODULO)
+
+// BCC2 is one XOR byte or a CRC-16/CRC-32, sent least significant byte first
+#define MAX_CHECK_SIZE 4
+
+// Data field of a frame: payload and BCC2, Reed-Solomon encoded if FEC is on
+#define FIELD_SIZE(payloadSize) FEC_MAX_ENCODED_SIZE((payloadSize) + MAX_CHECK_SIZE)
+
+// FLAG, A, C, BCC1, stuffed data field (every byte may be escaped), FLAG
+#define FRAME_SIZE(payloadSize) (4 + 2 * FIELD_SIZE(payloadSize) + 1)
+
+// Parameters carried in SET/UA as type, length, big-endian value
+#define P_MAX_PAYLOAD 0x01 // Largest I-frame payload, 2 bytes
+#define P_SEGMENTATION 0x02 // Messages may span several I-frames, no value
+#define P_FEC 0x03 // I-frame data fields are Reed-Solomon encoded, 1 byte: interleaving depth
+#define P_DUPLEX 0x04 // Both ends send I-frames, with N(R) piggybacked, no value
+#define P_CHANNELS 0x05 // Logical channels multiplexed in the payloads, 1 byte: count
+#define P_FEATURES 0x06 // Application feature bits, 1 byte
+#define MAX_PARAMETERS_SIZE 17
+
+// Frame size adaptation: outcomes of the last ADAPT_WINDOW acknowledged frames
+// are kept, and the segment size is recomputed every ADAPT_INTERVAL of them
+#define ADAPT_WINDOW 32
+#define ADAPT_INTERVAL 8
+#define MIN_SEGMENT_SIZE 64
+
+// Bytes read from the port but not yet parsed; a power of two
+#define RX_RING_SIZE 8192
 
-#define TIMEOUT 3
-#define MAX_RETRIES 3
+// Full duplex: I-frames received in sequence outside llread() that are kept for it
+#define RX_QUEUE_SIZE LL_SEQ_MODULO
 
-int fd; // File descriptor da porta série
+typedef enum {
+    START,
+    FLAG_RCV,
+    A_RCV,
+    C_RCV,
+    BCC_OK,
+    DATA_RCV,
+    ESC_RCV,
+    STOP_
+} State;
 
-// Função que será chamada quando o alarme disparar (timeout)
-void alarmHandler(int sig) {
-    // Lidar com o timeout se necessário
+// I-frames are built and checked this many payload bytes at a time, so that
+// the frame check and the stuffing work on data that is still in cache
+#define FUSED_BLOCK_SIZE 256
+
+// A received frame. The data field of I-frames (or SET/UA parameters) is
+// destuffed straight into its destination: the first "capacity" bytes go to
+// "data" and the rest, which can only be the end of BCC2, to "tail".
+// Encoded data fields are destuffed into a scratch buffer instead, and
+// corrected into "decoded" once complete.
+typedef struct {
+    unsigned char a;
+    unsigned char c;
+    unsigned char *data;
+    int capacity;
+    int inPacket; // TRUE if "data" or "decoded" points into the packet of llread()
+    int coded;    // TRUE if the data field is Reed-Solomon encoded
+    unsigned char *decoded; // Where the payload and BCC2 of an encoded field go
+    unsigned char tail[MAX_CHECK_SIZE];
+    int size;       // Data field bytes so far; the payload size once received
+    uint32_t check; // Frame check register, updated while destuffing
+    int bcc2Ok;
+} Frame;
+
+// Most segments a frame sent with writev() may have; more fragmented frames
+// are stuffed into a single buffer instead
+#define MAX_FRAME_IOVS 64
+
+// An I-frame kept until acknowledged, ready to be resent as is but for N(R)
+// in full duplex. Either the whole stuffed frame is in "frame", or "iov" lists
+// its segments: the clean runs of the caller's payload, referenced in place,
+// and the header, escape sequences and trailer, stored in "frame". Either way
+// the header starts "frame".
+typedef struct {
+    unsigned char *frame; // FRAME_SIZE(maxPayload) bytes
+    struct iovec iov[MAX_FRAME_IOVS];
+    int iovCount; // 0 when the frame is all in "frame"
+    int frameSize;
+    long long sentAt;   // When the last transmission left the port, in CLOCK_MONOTONIC us
+    long long deadline; // Retransmission deadline, in CLOCK_MONOTONIC us
+    int transmissions;  // Times this frame was written to the port
+    int retries;        // Times this frame was resent after a timeout
+    int failures;       // Transmissions of this frame that failed: its timeouts, REJ or SREJ
+    int endsSubmission; // TRUE if this is the last frame of a message given to llsubmit()
+    const unsigned char *payload; // The caller's payload, while "iov" references it
+    int payloadSize;
+} TxSlot;
+
+// Selective Repeat receive buffer entry for a frame that arrived out of order.
+typedef struct {
+    unsigned char *data; // maxPayload + MAX_CHECK_SIZE bytes
+    int size;
+    int more;    // TRUE if the next frame continues the same message
+    int present;
+    int srejSent; // TRUE once a SREJ was sent asking for this frame
+} RxSlot;
+
+// A message given to llsubmit(), referenced in place until acknowledged.
+typedef struct {
+    const unsigned char *buf;
+    int size;
+    int framed;     // Bytes of "buf" already put in I-frames
+    int frameBytes; // Total size of those frames
+    LlCompletion callback;
+    void *context;
+} Submission;
+
+// Full duplex: a message received and acknowledged while llread() was not
+// running, waiting to be delivered by it.
+typedef struct {
+    unsigned char *data; // maxPayload + MAX_CHECK_SIZE bytes
+    int size;
+} QueuedMessage;
+
+static struct {
+    int fd;
+    int timerFd; // timerfd for the retransmission and inactivity timers
+    int waitLimit; // Longest wait for input in ms before giving up as if the timer expired, -1 for none
+    LinkLayer params;
+    LinkLayerOptions options;
+    struct termios oldtio;
+    long long lineIdleAt; // When everything written so far has left the port, in us
+    int maxPayload;   // Largest payload our buffers hold (options.maxPayloadSize)
+    int payloadLimit; // Largest payload agreed with the peer in SET/UA
+    int segmentation; // TRUE if agreed in SET/UA: messages may span several I-frames
+    int fecDepth;     // Agreed in SET/UA: interleaving depth of Reed-Solomon encoded I-frames, 0 without FEC
+    int duplex;       // TRUE if agreed in SET/UA: both ends send I-frames
+    int channels;     // Agreed in SET/UA: logical channels, 1 without multiplexing
+    int features;     // Agreed in SET/UA: application feature bits both ends offered
+    unsigned char txAddress; // Address of the I-frames we send and of the S-frames acknowledging them
+    unsigned char rxAddress; // Address of the I-frames we receive and of the S-frames we answer with
+    LinkStatistics stats; // Kept after llclose() until the next llopen()
+
+    // Transmitter
+    TxSlot window[LL_SEQ_MODULO];
+    int vs;      // V(S): sequence number of the next new I-frame
+    int va;      // V(A): oldest unacknowledged sequence number
+    int goBackFrom;       // Go-Back-N: N(S) the last resend of the window started from
+    long long goBackAt;   // and when it started, in us
+
+    // Retransmission timeout, estimated from round trip times (RFC 6298)
+    double srtt;   // Smoothed round trip time in us, negative before the first sample
+    double rttvar; // Round trip time variation in us
+    long long rto; // Current retransmission timeout in us
+
+    // Frame size adaptation, driven by the transmissions each frame needed
+    int segmentSize; // Payload currently put in each I-frame
+    int historyBytes[ADAPT_WINDOW];    // Bytes put on the line for each frame
+    int historyFailures[ADAPT_WINDOW]; // Transmissions that failed themselves
+    int historyCount;
+    int historyNext;
+
+    // Asynchronous writes, framed in order as the window has room; the
+    // submission with handle "submitFirstHandle" is the oldest one
+    Submission submissions[LL_MAX_SUBMISSIONS];
+    int submitHead;
+    int submitCount;
+    int submitFramed; // Submissions from the head completely put in I-frames
+    int submitFirstHandle;
+    int submitFailedHandle; // Handles from this one on failed, 0 if none did
+
+    // Forward error correction of I-frames
+    unsigned char *txMessage; // Payload and BCC2 to encode, maxPayload + MAX_CHECK_SIZE bytes
+    unsigned char *txField;   // Encoded data field, FIELD_SIZE(maxPayload) bytes
+
+    // Receive path: ring of raw bytes and the frame being parsed
+    unsigned char rxRing[RX_RING_SIZE];
+    size_t rxHead; // Total bytes written to the ring
+    size_t rxTail; // Total bytes parsed
+    State rxState;
+    Frame rxFrame;
+    unsigned char *rxBuffer;  // Data field of frames that are not kept, FIELD_SIZE(maxPayload) bytes
+    unsigned char *rxDecoded; // Decoded payload and BCC2 of those, maxPayload + MAX_CHECK_SIZE bytes
+    unsigned char *rxPacket; // Packet of the llread() in progress, NULL outside it
+    int rxPacketSize;
+    int rxAssembled; // Bytes of the message already in rxPacket
+
+    // Receiver
+    RxSlot reorder[LL_SEQ_MODULO];
+    int vr;      // V(R): next expected sequence number
+    int vd;      // Next sequence number to deliver; frames in [vd, vr) wait in reorder
+    int rejSent; // TRUE once a REJ was sent for the current gap
+    int discReceived; // TRUE if the transmitter asked to disconnect during llread()
+    long long rxDeadline; // llread() gives up on the peer at this time, 0 outside it
+    int ackPending; // Full duplex: V(R) advanced and the RR waits for an I-frame to carry it
+    QueuedMessage rxQueue[RX_QUEUE_SIZE];
+    int rxQueueHead;
+    int rxQueueCount;
+} ll = {
+    .fd = -1,
+    .timerFd = -1,
+    .waitLimit = -1,
+    .options = { .arq = LlStopAndWait, .windowSize = 1, .frameCheck = LlCheckXor,
+                 .maxPayloadSize = MAX_PAYLOAD_SIZE, .fecInterleaveDepth = 1 },
+};
+
+static long long monotonicUs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
 }
 
-// A função llopen é responsável por abrir a porta e estabelecer a comunicação
-int llopen(LinkLayer connectionParameters) {
-    struct termios oldtio, newtio;
+// Arm the timer to expire "us" microseconds from now. Re-arming discards any
+// expiration not yet consumed; zero or less expires right away.
+static void timerStart(long long us) {
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(timer));
+    if (us <= 0) {
+        timer.it_value.tv_nsec = 1;
+    } else {
+        timer.it_value.tv_sec = us / 1000000;
+        timer.it_value.tv_nsec = (us % 1000000) * 1000;
+    }
+    timerfd_settime(ll.timerFd, 0, &timer, NULL);
+}
+
+static void timerStop(void) {
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(timer));
+    timerfd_settime(ll.timerFd, 0, &timer, NULL);
+}
+
+// Block until the serial port is readable or the timer expires, or for
+// "waitLimit" ms at most.
+// Return "1" if there is data to read, "0" if the timer expired or the wait
+// limit passed, or "-1" on error.
+static int waitForEvent(void) {
+    struct pollfd fds[2] = {
+        { .fd = ll.fd, .events = POLLIN },
+        { .fd = ll.timerFd, .events = POLLIN },
+    };
+
+    while (TRUE) {
+        int ready = poll(fds, 2, ll.waitLimit);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return -1;
+        }
+        if (ready == 0) return 0;
+
+        if (fds[1].revents & POLLIN) {
+            uint64_t expirations;
+            if (read(ll.timerFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+                perror("read timer");
+                return -1;
+            }
+            return 0;
+        }
+        if (fds[0].revents & POLLIN) return 1;
+        if (fds[0].revents & (POLLHUP | POLLERR | POLLNVAL)) {
+            printf("Serial port closed\n");
+            return -1;
+        }
+    }
+}
+
+////////////////////////////////////////////////
+// RETRANSMISSION TIMEOUT
+////////////////////////////////////////////////
+// Lower bound for the RTO; the user timeout is the upper bound
+#define RTO_MIN_US 50000LL
+// RTO before the first round trip is measured
+#define RTO_INITIAL_US 1000000LL
+
+static long long clampRto(double rto) {
+    long long maxRto = ll.params.timeout * 1000000LL;
+    if (rto > maxRto) return maxRto;
+    if (rto < RTO_MIN_US) return RTO_MIN_US;
+    return (long long) rto;
+}
+
+static void rtoReset(void) {
+    ll.srtt = -1;
+    ll.rttvar = 0;
+    ll.rto = clampRto(RTO_INITIAL_US);
+}
+
+// In full duplex an acknowledgement may have to wait behind a whole frame the
+// peer is sending, whether or not the samples so far met one.
+static double acknowledgementDelay(void) {
+    if (!ll.duplex) return 0;
+    int fieldSize = ll.payloadLimit + MAX_CHECK_SIZE;
+    if (ll.fecDepth > 0) fieldSize = fecEncodedSize(fieldSize, ll.fecDepth);
+    return (4 + fieldSize + 1) * 10000000.0 / ll.params.baudRate;
+}
+
+// Feed a round trip time measured on a frame that was sent only once (Karn's rule).
+// The round trip starts when the frame left the port, so frame size and queueing
+// behind earlier frames do not inflate it.
+static void rtoSample(long long rtt) {
+    if (rtt < 0) rtt = 0;
+
+    if (ll.srtt < 0) {
+        ll.srtt = rtt;
+        ll.rttvar = rtt / 2.0;
+    } else {
+        double error = ll.srtt > rtt ? ll.srtt - rtt : rtt - ll.srtt;
+        ll.rttvar = 0.75 * ll.rttvar + 0.25 * error;
+        ll.srtt = 0.875 * ll.srtt + 0.125 * rtt;
+    }
+
+    statsRecordRtt(&ll.stats, rtt);
+
+    // At least one byte time of margin
+    double byteTime = 10000000.0 / ll.params.baudRate;
+    double variation = 4 * ll.rttvar > byteTime ? 4 * ll.rttvar : byteTime;
+    ll.rto = clampRto(ll.srtt + variation + acknowledgementDelay());
+}
+
+// Exponential backoff after a timeout, kept until the next valid sample.
+static void rtoBackoff(void) {
+    ll.rto = clampRto(ll.rto * 2.0);
+}
+
+////////////////////////////////////////////////
+// OPTIONS
+////////////////////////////////////////////////
+void lldefaultoptions(LinkLayerOptions *options) {
+    options->arq = LlStopAndWait;
+    options->windowSize = 1;
+    options->frameCheck = LlCheckXor;
+    options->maxPayloadSize = MAX_PAYLOAD_SIZE;
+    options->adaptiveFrameSize = FALSE;
+    options->forwardErrorCorrection = FALSE;
+    options->fecInterleaveDepth = 1;
+    options->fullDuplex = FALSE;
+    options->channels = 1;
+    options->features = 0;
+}
+
+int llsetoptions(const LinkLayerOptions *options) {
+    switch (options->arq) {
+    case LlStopAndWait:
+        if (options->windowSize != 1) return -1;
+        break;
+    case LlGoBackN:
+        if (options->windowSize < 1 || options->windowSize > LL_SEQ_MODULO - 1) return -1;
+        break;
+    case LlSelectiveRepeat:
+        // Sender and receiver windows must not overlap modulo 8
+        if (options->windowSize < 1 || options->windowSize > LL_SEQ_MODULO / 2) return -1;
+        break;
+    default:
+        return -1;
+    }
+
+    if (options->frameCheck != LlCheckXor && options->frameCheck != LlCheckCrc16 &&
+        options->frameCheck != LlCheckCrc32) {
+        return -1;
+    }
+
+    if (options->maxPayloadSize < MAX_PAYLOAD_SIZE || options->maxPayloadSize > LL_MAX_JUMBO_PAYLOAD) {
+        return -1;
+    }
+
+    if (options->fecInterleaveDepth < 1 || options->fecInterleaveDepth > FEC_MAX_DEPTH) return -1;
+    if (options->channels < 1 || options->channels > LL_MAX_CHANNELS) return -1;
+    if (options->features < 0 || options->features > 0xFF) return -1;
+
+    ll.options = *options;
+    return 1;
+}
+
+////////////////////////////////////////////////
+// SERIAL PORT
+////////////////////////////////////////////////
+static speed_t baudRateToSpeed(int baudRate) {
+    switch (baudRate) {
+    case 1200: return B1200;
+    case 1800: return B1800;
+    case 2400: return B2400;
+    case 4800: return B4800;
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 500000: return B500000;
+    case 576000: return B576000;
+    case 921600: return B921600;
+    case 1000000: return B1000000;
+    case 1152000: return B1152000;
+    case 1500000: return B1500000;
+    case 2000000: return B2000000;
+    case 2500000: return B2500000;
+    case 3000000: return B3000000;
+    case 3500000: return B3500000;
+    case 4000000: return B4000000;
+    default: return B0;
+    }
+}
+
+static int openSerialPort(const LinkLayer *params) {
+    speed_t speed = baudRateToSpeed(params->baudRate);
+    if (speed == B0) {
+        fprintf(stderr, "Unsupported baud rate %d\n", params->baudRate);
+        return -1;
+    }
 
-    // 1️⃣ Abrir a porta série
-    fd = open(connectionParameters.serialPort, O_RDWR | O_NOCTTY);
+    int fd = open(params->serialPort, O_RDWR | O_NOCTTY);
     if (fd < 0) {
-        perror("Erro ao abrir a porta série");
+        perror(params->serialPort);
         return -1;
     }
 
-    // 2️⃣ Guardar configuração atual e configurar nova
-    if (tcgetattr(fd, &oldtio) == -1) {
-        perror("Erro ao obter atributos da porta");
+    if (tcgetattr(fd, &ll.oldtio) == -1) {
+        perror("tcgetattr");
+        close(fd);
         return -1;
     }
 
+    struct termios newtio;
     memset(&newtio, 0, sizeof(newtio));
-    newtio.c_cflag = connectionParameters.baudRate | CS8 | CLOCAL | CREAD;
+    newtio.c_cflag = speed | CS8 | CLOCAL | CREAD;
     newtio.c_iflag = IGNPAR;
     newtio.c_oflag = 0;
     newtio.c_lflag = 0;
+    // read() never blocks, waiting is done with poll()
     newtio.c_cc[VTIME] = 0;
-    newtio.c_cc[VMIN] = 1;
+    newtio.c_cc[VMIN] = 0;
 
-    tcflush(fd, TCIFLUSH);
+    tcflush(fd, TCIOFLUSH);
     if (tcsetattr(fd, TCSANOW, &newtio) == -1) {
-        perror("Erro ao configurar atributos da porta");
+        perror("tcsetattr");
+        close(fd);
         return -1;
     }
 
-    // 3️⃣ Enviar trama SET
-    unsigned char set_frame[] = {FLAG, A, C_SET, BCC_SET, FLAG};
-    int retries = 0;
-    unsigned char response[5];
+    return fd;
+}
+
+// Allocate the frame buffers for payloads of up to ll.maxPayload bytes.
+// Return "0" on success or "-1" if out of memory.
+static int allocateBuffers(void) {
+    for (int i = 0; i < LL_SEQ_MODULO; i++) {
+        ll.window[i].frame = malloc(FRAME_SIZE(ll.maxPayload));
+        ll.reorder[i].data = malloc(ll.maxPayload + MAX_CHECK_SIZE);
+        if (ll.window[i].frame == NULL || ll.reorder[i].data == NULL) return -1;
+    }
+    for (int i = 0; i < RX_QUEUE_SIZE && ll.options.fullDuplex; i++) {
+        ll.rxQueue[i].data = malloc(ll.maxPayload + MAX_CHECK_SIZE);
+        if (ll.rxQueue[i].data == NULL) return -1;
+    }
+    ll.txMessage = malloc(ll.maxPayload + MAX_CHECK_SIZE);
+    ll.txField = malloc(FIELD_SIZE(ll.maxPayload));
+    ll.rxBuffer = malloc(FIELD_SIZE(ll.maxPayload));
+    ll.rxDecoded = malloc(ll.maxPayload + MAX_CHECK_SIZE);
+    if (ll.txMessage == NULL || ll.txField == NULL || ll.rxBuffer == NULL || ll.rxDecoded == NULL) return -1;
+    return 0;
+}
+
+static void freeBuffers(void) {
+    for (int i = 0; i < LL_SEQ_MODULO; i++) {
+        free(ll.window[i].frame);
+        free(ll.reorder[i].data);
+        ll.window[i].frame = NULL;
+        ll.reorder[i].data = NULL;
+    }
+    for (int i = 0; i < RX_QUEUE_SIZE; i++) {
+        free(ll.rxQueue[i].data);
+        ll.rxQueue[i].data = NULL;
+    }
+    free(ll.txMessage);
+    free(ll.txField);
+    free(ll.rxBuffer);
+    free(ll.rxDecoded);
+    ll.txMessage = NULL;
+    ll.txField = NULL;
+    ll.rxBuffer = NULL;
+    ll.rxDecoded = NULL;
+}
+
+// Restore the port and release everything llopen() acquired.
+static void closeSerialPort(void) {
+    // Let pending output drain before restoring the old settings
+    tcdrain(ll.fd);
+    if (tcsetattr(ll.fd, TCSANOW, &ll.oldtio) == -1) {
+        perror("tcsetattr");
+    }
+    close(ll.fd);
+    ll.fd = -1;
+
+    if (ll.timerFd >= 0) {
+        close(ll.timerFd);
+        ll.timerFd = -1;
+    }
+
+    freeBuffers();
+}
+
+// Advance the estimate of when the port goes idle by "size" bytes written to
+// it (10 bit times per byte at the configured baud rate).
+static void lineSent(int size) {
+    long long now = monotonicUs();
+    if (ll.lineIdleAt < now) ll.lineIdleAt = now;
+    ll.lineIdleAt += size * 10000000LL / ll.params.baudRate;
+}
+
+// Count a frame given to the port, from its control field.
+static void countSent(unsigned char c, int size) {
+    ll.stats.wireBytesSent += size;
+    if (IS_I_FRAME(c)) {
+        ll.stats.iFramesSent++;
+        ll.stats.iFrameBytesSent += size;
+    } else if (IS_S_FRAME(c)) {
+        ll.stats.sFramesSent++;
+        if (S_TYPE(c) == S_REJ) ll.stats.rejSent++;
+        if (S_TYPE(c) == S_SREJ) ll.stats.srejSent++;
+    } else {
+        ll.stats.uFramesSent++;
+    }
+}
+
+// Write a whole frame.
+static int writeAll(const unsigned char *buf, int size) {
+    countSent(buf[2], size);
+    int written = 0;
+    while (written < size) {
+        int res = write(ll.fd, buf + written, size - written);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            perror("write");
+            return -1;
+        }
+        written += res;
+    }
 
-    // Configurar alarme para o timeout
-    signal(SIGALRM, alarmHandler);
-    
-    while (retries < MAX_RETRIES) {
-        write(fd, set_frame, 5);
-        printf("SET enviado. Tentativa %d\n", retries + 1);
+    lineSent(size);
+    return written;
+}
 
-        // 4️⃣ Esperar resposta UA
-        alarm(TIMEOUT);
-        int res = read(fd, response, 5);
-        alarm(0);
+// Write "size" bytes given as "count" segments, with a single writev() unless
+// the port takes them in parts.
+static int writeSegments(const struct iovec *segments, int count, int size) {
+    countSent(((const unsigned char *) segments[0].iov_base)[2], size);
+    struct iovec iov[MAX_FRAME_IOVS];
+    memcpy(iov, segments, count * sizeof(struct iovec));
+    struct iovec *next = iov;
 
-        if (res == 5 && response[0] == FLAG && response[1] == A && response[2] == C_UA && response[3] == BCC_UA && response[4] == FLAG) {
-            printf("Recebido UA! Conexão estabelecida.\n");
-            return fd; // Sucesso
+    int written = 0;
+    while (written < size) {
+        ssize_t res = writev(ll.fd, next, count);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            perror("writev");
+            return -1;
         }
+        written += res;
 
-        retries++;
+        // Skip what was written, which may end in the middle of a segment
+        while (count > 0 && (size_t) res >= next->iov_len) {
+            res -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0) {
+            next->iov_base = (unsigned char *) next->iov_base + res;
+            next->iov_len -= res;
+        }
     }
 
-    printf("Falha ao estabelecer ligação.\n");
-    return -1;
+    lineSent(size);
+    return written;
 }
+
 ////////////////////////////////////////////////
-// LLWRITE
+// FRAMES
 ////////////////////////////////////////////////
-int llwrite(const unsigned char *buf, int bufSize)
-{
-    // TODO
+static int buildSupervision(unsigned char *frame, unsigned char a, unsigned char c) {
+    frame[0] = FLAG;
+    frame[1] = a;
+    frame[2] = c;
+    frame[3] = a ^ c;
+    frame[4] = FLAG;
+    return 5;
+}
+
+static int sendSupervision(unsigned char a, unsigned char c) {
+    unsigned char frame[5];
+    return writeAll(frame, buildSupervision(frame, a, c));
+}
+
+static int checkSize(void) {
+    switch (ll.options.frameCheck) {
+    case LlCheckCrc16: return 2;
+    case LlCheckCrc32: return 4;
+    default: return 1;
+    }
+}
+
+// BCC2 is computed on a register that is updated piece by piece, so that it
+// can be fused with stuffing and destuffing.
+static uint32_t checkInit(void) {
+    switch (ll.options.frameCheck) {
+    case LlCheckCrc16: return CRC16_INIT;
+    case LlCheckCrc32: return CRC32_INIT;
+    default: return 0;
+    }
+}
+
+static uint32_t checkUpdate(uint32_t check, const unsigned char *buf, size_t size) {
+    switch (ll.options.frameCheck) {
+    case LlCheckCrc16: return crc16Update(check, buf, size);
+    case LlCheckCrc32: return crc32Update(check, buf, size);
+    default:
+        for (size_t i = 0; i < size; i++) {
+            check ^= buf[i];
+        }
+        return check;
+    }
+}
+
+// Write the BCC2 bytes of a register updated over the whole payload.
+// Return the number of bytes written.
+static int checkFinal(uint32_t check, unsigned char *bcc2) {
+    switch (ll.options.frameCheck) {
+    case LlCheckCrc16:
+        check ^= CRC16_XOROUT;
+        break;
+    case LlCheckCrc32:
+        check ^= CRC32_XOROUT;
+        break;
+    default:
+        break;
+    }
+
+    int size = checkSize();
+    for (int i = 0; i < size; i++) {
+        bcc2[i] = (check >> (8 * i)) & 0xFF;
+    }
+    return size;
+}
+
+// TRUE if a register updated over the payload followed by its BCC2 holds the
+// known residue (zero for the XOR), meaning both are intact.
+static int checkResidueOk(uint32_t check) {
+    switch (ll.options.frameCheck) {
+    case LlCheckCrc16: return check == CRC16_RESIDUE;
+    case LlCheckCrc32: return check == CRC32_RESIDUE;
+    default: return check == 0;
+    }
+}
+
+// Build a complete frame with a data field (header, stuffed data and BCC2,
+// trailing flag): an I-frame or a SET/UA with parameters.
+// The data is read once: each block is checked and stuffed while in cache.
+// Return the size of the frame.
+static int buildFrame(unsigned char *frame, unsigned char a, unsigned char c, const unsigned char *buf, int bufSize) {
+    int size = 0;
+    frame[size++] = FLAG;
+    frame[size++] = a;
+    frame[size++] = c;
+    frame[size++] = a ^ c;
+
+    uint32_t check = checkInit();
+    for (int offset = 0; offset < bufSize; offset += FUSED_BLOCK_SIZE) {
+        int block = bufSize - offset < FUSED_BLOCK_SIZE ? bufSize - offset : FUSED_BLOCK_SIZE;
+        check = checkUpdate(check, buf + offset, block);
+        size += stuffBytes(buf + offset, block, frame + size);
+    }
+
+    unsigned char bcc2[MAX_CHECK_SIZE];
+    int bcc2Size = checkFinal(check, bcc2);
+    size += stuffBytes(bcc2, bcc2Size, frame + size);
+    frame[size++] = FLAG;
+    return size;
+}
+
+// Build an I-frame with forward error correction: the payload and its BCC2
+// are Reed-Solomon encoded, then stuffed. The receiver decodes after finding
+// the flags and destuffing, so errors that turn a byte into FLAG or ESC, or
+// the other way round, lose the frame before the code can correct anything.
+// Return the size of the frame.
+static int buildCodedFrame(unsigned char *frame, unsigned char c, const unsigned char *buf, int bufSize) {
+    memcpy(ll.txMessage, buf, bufSize);
+    int messageSize = bufSize + checkFinal(checkUpdate(checkInit(), buf, bufSize), ll.txMessage + bufSize);
+    int fieldSize = fecEncode(ll.txMessage, messageSize, ll.fecDepth, ll.txField);
+
+    int size = 0;
+    frame[size++] = FLAG;
+    frame[size++] = ll.txAddress;
+    frame[size++] = c;
+    frame[size++] = ll.txAddress ^ c;
+    size += stuffBytes(ll.txField, fieldSize, frame + size);
+    frame[size++] = FLAG;
+    return size;
+}
+
+// Build an I-frame into a single buffer, encoded if FEC was agreed.
+static int buildIFrame(unsigned char *frame, unsigned char c, const unsigned char *buf, int bufSize) {
+    if (ll.fecDepth > 0) return buildCodedFrame(frame, c, buf, bufSize);
+    return buildFrame(frame, ll.txAddress, c, buf, bufSize);
+}
+
+// Append a segment to the frame of "slot", merging it with the previous one
+// when they are contiguous. Return "0" on success or "-1" if the list is full.
+static int appendSegment(TxSlot *slot, const unsigned char *base, int size) {
+    if (slot->iovCount > 0) {
+        struct iovec *last = &slot->iov[slot->iovCount - 1];
+        if ((const unsigned char *) last->iov_base + last->iov_len == base) {
+            last->iov_len += size;
+            return 0;
+        }
+    }
 
+    if (slot->iovCount == MAX_FRAME_IOVS) return -1;
+    slot->iov[slot->iovCount].iov_base = (void *) base;
+    slot->iov[slot->iovCount].iov_len = size;
+    slot->iovCount++;
     return 0;
 }
 
+// Describe an I-frame as segments for writev(), without copying the clean
+// runs of "buf", which must stay valid until the frame is acknowledged.
+// Return the size of the frame or "-1" if it needs more than MAX_FRAME_IOVS
+// segments.
+static int mapIFrame(TxSlot *slot, unsigned char c, const unsigned char *buf, int bufSize) {
+    unsigned char *stored = slot->frame;
+    stored[0] = FLAG;
+    stored[1] = ll.txAddress;
+    stored[2] = c;
+    stored[3] = ll.txAddress ^ c;
+
+    slot->iovCount = 0;
+    appendSegment(slot, stored, 4);
+    stored += 4;
+
+    uint32_t check = checkInit();
+    for (int offset = 0; offset < bufSize; offset += FUSED_BLOCK_SIZE) {
+        int block = bufSize - offset < FUSED_BLOCK_SIZE ? bufSize - offset : FUSED_BLOCK_SIZE;
+        check = checkUpdate(check, buf + offset, block);
+
+        // Runs split at block boundaries are merged back by appendSegment()
+        int i = offset;
+        while (i < offset + block) {
+            int run = stuffingCleanRun(buf + i, offset + block - i);
+            if (run > 0 && appendSegment(slot, buf + i, run) < 0) return -1;
+            i += run;
+            if (i == offset + block) break;
+
+            stored[0] = ESC;
+            stored[1] = buf[i++] ^ ESC_MASK;
+            if (appendSegment(slot, stored, 2) < 0) return -1;
+            stored += 2;
+        }
+    }
+
+    unsigned char bcc2[MAX_CHECK_SIZE];
+    int trailerSize = stuffBytes(bcc2, checkFinal(check, bcc2), stored);
+    stored[trailerSize++] = FLAG;
+    if (appendSegment(slot, stored, trailerSize) < 0) return -1;
+
+    int size = 0;
+    for (int i = 0; i < slot->iovCount; i++) {
+        size += slot->iov[i].iov_len;
+    }
+    return size;
+}
+
+// Where to destuff the data field of a frame: an I-frame goes straight into
+// the packet of llread() if it is the next expected frame and any payload
+// fits, into the queue if it is the next expected frame outside llread() in
+// full duplex, into its reorder slot if Selective Repeat may keep it, or into
+// a scratch buffer otherwise, like SET/UA parameters. Encoded I-frames are
+// destuffed into the scratch buffer and decoded into the same destinations.
+static void chooseDestination(Frame *frame) {
+    frame->data = ll.rxBuffer;
+    frame->capacity = ll.maxPayload;
+    frame->inPacket = FALSE;
+    frame->coded = FALSE;
+    if (!IS_I_FRAME(frame->c)) return;
+
+    unsigned char *destination = ll.rxBuffer;
+    int capacity = ll.maxPayload;
+    int needed = ll.maxPayload;
+    if (ll.fecDepth > 0) {
+        destination = ll.rxDecoded;
+        needed += MAX_CHECK_SIZE;
+    }
+
+    // Segments of a message are appended to what is already there
+    int ns = C_NS(frame->c);
+    int space = ll.rxPacketSize - ll.rxAssembled;
+    if (ll.rxPacket != NULL && ns == ll.vr && space >= needed) {
+        destination = ll.rxPacket + ll.rxAssembled;
+        capacity = space;
+        frame->inPacket = TRUE;
+    } else if (ll.rxPacket == NULL && ll.duplex && ns == ll.vr && ll.vd == ll.vr &&
+               ll.rxQueueCount < RX_QUEUE_SIZE) {
+        destination = ll.rxQueue[(ll.rxQueueHead + ll.rxQueueCount) % RX_QUEUE_SIZE].data;
+    } else if (ll.options.arq == LlSelectiveRepeat && !ll.reorder[ns].present) {
+        destination = ll.reorder[ns].data;
+    }
+
+    if (ll.fecDepth > 0) {
+        frame->capacity = FIELD_SIZE(ll.maxPayload);
+        frame->coded = TRUE;
+        frame->decoded = destination;
+    } else {
+        frame->data = destination;
+        frame->capacity = capacity;
+    }
+}
+
+// Destuff the data field of a frame from "chunk" into its destination,
+// updating the frame check on the way unless the field is encoded.
+// Return the number of bytes consumed.
+static size_t destuffDataField(const unsigned char *chunk, size_t size, int *escaped) {
+    Frame *frame = &ll.rxFrame;
+    size_t consumed = 0;
+    size_t destuffed = 0;
+
+    while (TRUE) {
+        int inPayload = frame->size < frame->capacity;
+        unsigned char *out;
+        size_t space;
+        if (inPayload) {
+            out = frame->data + frame->size;
+            space = frame->capacity - frame->size;
+        } else {
+            out = frame->tail + (frame->size - frame->capacity);
+            space = frame->capacity + MAX_CHECK_SIZE - frame->size;
+        }
+
+        size_t written;
+        consumed += destuffBytes(chunk + consumed, size - consumed, out, space, &written, escaped);
+        if (!frame->coded) frame->check = checkUpdate(frame->check, out, written);
+        frame->size += written;
+        destuffed += written;
+
+        // Go on into the tail only if the payload part just filled up
+        if (!inPayload || frame->size < frame->capacity) {
+            ll.stats.stuffingBytesReceived += consumed - destuffed;
+            return consumed;
+        }
+    }
+}
+
+// Run the frame state machine over a chunk of received bytes.
+// Return the number of bytes consumed, stopping right after a complete frame
+// (ll.rxState == STOP_) so that the rest is kept for the next frame.
+static size_t parseChunk(const unsigned char *chunk, size_t size) {
+    Frame *frame = &ll.rxFrame;
+    State state = ll.rxState;
+    size_t i = 0;
+
+    while (i < size && state != STOP_) {
+        if (state == DATA_RCV || state == ESC_RCV) {
+            // Destuff the whole run up to the closing flag at once
+            int escaped = state == ESC_RCV;
+            i += destuffDataField(chunk + i, size - i, &escaped);
+            state = escaped ? ESC_RCV : DATA_RCV;
+            if (i == size) break;
+
+            // Stopped at a flag, or the frame is too long to be valid
+            if (chunk[i++] != FLAG) {
+                state = START;
+            } else {
+                state = escaped ? FLAG_RCV : STOP_; // ESC followed by a flag aborts the frame
+            }
+            continue;
+        }
+
+        unsigned char byte = chunk[i++];
+
+        switch (state) {
+        case START:
+            if (byte == FLAG) state = FLAG_RCV;
+            break;
+
+        case FLAG_RCV:
+            if (byte == A_TX || byte == A_RX) {
+                frame->a = byte;
+                state = A_RCV;
+            } else if (byte != FLAG) {
+                state = START;
+            }
+            break;
+
+        case A_RCV:
+            if (byte == FLAG) {
+                state = FLAG_RCV;
+            } else {
+                frame->c = byte;
+                state = C_RCV;
+            }
+            break;
+
+        case C_RCV:
+            if (byte == (frame->a ^ frame->c)) {
+                frame->size = 0;
+                frame->coded = FALSE;
+                if (IS_I_FRAME(frame->c) || HAS_PARAMETERS(frame->c)) {
+                    chooseDestination(frame);
+                    frame->check = checkInit();
+                }
+                state = BCC_OK;
+            } else {
+                ll.stats.bcc1Errors++;
+                state = byte == FLAG ? FLAG_RCV : START;
+            }
+            break;
+
+        case BCC_OK:
+            if (!IS_I_FRAME(frame->c) && byte == FLAG) {
+                // Supervision and unnumbered frames end right after BCC1...
+                state = STOP_;
+            } else if (!IS_I_FRAME(frame->c) && !HAS_PARAMETERS(frame->c)) {
+                // ...except for SET and UA, which may carry parameters
+                state = START;
+            } else if (byte == FLAG) {
+                // I-frame without payload nor BCC2, treat the flag as a new start
+                state = FLAG_RCV;
+            } else {
+                // First byte of the data field, destuffed with the rest
+                i--;
+                state = DATA_RCV;
+            }
+            break;
+
+        default:
+            state = START;
+            break;
+        }
+    }
+
+    ll.rxState = state;
+    return i;
+}
+
+// Full duplex: send the RR that no I-frame carried, before waiting for input.
+static void flushAcknowledgement(void) {
+    if (!ll.ackPending) return;
+    ll.ackPending = FALSE;
+    sendSupervision(ll.rxAddress, C_RR(ll.vr));
+}
+
+// Read whatever the port has into the receive ring, waiting if it has nothing.
+// Return "1" if bytes were added, "0" if the timer expired or "-1" on error.
+static int fillReceiveRing(void) {
+    while (TRUE) {
+        // Non-blocking read sized to the contiguous free space: one call takes
+        // everything the driver has buffered
+        size_t used = ll.rxHead - ll.rxTail;
+        size_t offset = ll.rxHead % RX_RING_SIZE;
+        size_t space = RX_RING_SIZE - used;
+        if (space > RX_RING_SIZE - offset) space = RX_RING_SIZE - offset;
+
+        ssize_t res = read(ll.fd, ll.rxRing + offset, space);
+        if (res > 0) {
+            ll.rxHead += res;
+            ll.stats.wireBytesReceived += res;
+            return 1;
+        }
+        if (res < 0 && errno != EINTR && errno != EAGAIN) {
+            perror("read");
+            return -1;
+        }
+
+        flushAcknowledgement();
+        int event = waitForEvent();
+        if (event <= 0) return event;
+    }
+}
+
+// Correct an encoded data field into its destination, which then becomes the
+// data of the frame, and check the payload and BCC2 it holds.
+static void decodeField(Frame *frame) {
+    long messageSize = frame->size <= frame->capacity ? fecMessageSize(frame->size, ll.fecDepth) : -1;
+    size_t decodedSize;
+    frame->bcc2Ok = messageSize >= checkSize() && messageSize <= ll.maxPayload + checkSize() &&
+                    fecDecode(frame->data, frame->size, ll.fecDepth, frame->decoded, &decodedSize) >= 0 &&
+                    checkResidueOk(checkUpdate(checkInit(), frame->decoded, decodedSize));
+    frame->data = frame->decoded;
+    frame->size = messageSize - checkSize();
+}
+
+// Receive the next frame with a valid header. The frame stays valid until the
+// next call; bytes that follow it remain buffered.
+// Return "1" when a frame was received, "0" if the timer expired or "-1" on error.
+static int receiveFrame(Frame **received) {
+    while (TRUE) {
+        while (ll.rxHead != ll.rxTail) {
+            size_t offset = ll.rxTail % RX_RING_SIZE;
+            size_t size = ll.rxHead - ll.rxTail;
+            if (size > RX_RING_SIZE - offset) size = RX_RING_SIZE - offset;
+
+            ll.rxTail += parseChunk(ll.rxRing + offset, size);
+            if (ll.rxState == STOP_) break;
+        }
+
+        if (ll.rxState == STOP_) break;
+
+        int res = fillReceiveRing();
+        if (res <= 0) return res;
+    }
+
+    Frame *frame = &ll.rxFrame;
+    frame->bcc2Ok = TRUE;
+    if (frame->coded) {
+        decodeField(frame);
+    } else if (IS_I_FRAME(frame->c) || frame->size > 0) {
+        int payloadSize = frame->size - checkSize();
+        frame->bcc2Ok = payloadSize >= 0 && payloadSize <= frame->capacity &&
+                        checkResidueOk(frame->check);
+        frame->size = payloadSize;
+    }
+
+    if (IS_I_FRAME(frame->c)) {
+        ll.stats.iFramesReceived++;
+        if (!frame->bcc2Ok) ll.stats.bcc2Errors++;
+    } else if (IS_S_FRAME(frame->c)) {
+        ll.stats.sFramesReceived++;
+    } else {
+        ll.stats.uFramesReceived++;
+    }
+
+    // The closing flag may open the next frame too: after a line outage, the
+    // flag that ends what was left of a frame is the opening one of the next
+    ll.rxState = FLAG_RCV;
+    *received = frame;
+    return 1;
+}
+
+// Send a supervision/unnumbered command and wait for the expected reply,
+// retransmitting the command on every timeout, at most "attempts" times.
+// The reply stays in "*reply" (if not NULL) until the next frame is received.
+// Return "1" on success or "-1" if no reply arrived.
+static int exchangeCommand(const unsigned char *command, int commandSize, int attempts,
+                           unsigned char replyA, unsigned char replyC, Frame **reply) {
+    Frame *frame;
+
+    for (int attempt = 0; attempt < attempts; attempt++) {
+        if (writeAll(command, commandSize) < 0) return -1;
+        long long sentAt = ll.lineIdleAt;
+        timerStart(sentAt + ll.rto - monotonicUs());
+
+        while (TRUE) {
+            int res = receiveFrame(&frame);
+            if (res < 0) {
+                timerStop();
+                return -1;
+            }
+            if (res == 0) {
+                rtoBackoff();
+                ll.stats.timeouts++;
+                break;
+            }
+            if (frame->a == replyA && frame->c == replyC && frame->bcc2Ok) {
+                timerStop();
+                if (attempt == 0) rtoSample(monotonicUs() - sentAt);
+                if (reply != NULL) *reply = frame;
+                return 1;
+            }
+            if (ll.duplex && frame->a == ll.rxAddress && IS_I_FRAME(frame->c)) {
+                // The peer still resends I-frames whose RR was lost
+                sendSupervision(ll.rxAddress, C_RR(ll.vr));
+            }
+        }
+    }
+
+    timerStop();
+    return -1;
+}
+
+// Same as exchangeCommand() for a command without parameters, with the whole
+// retry budget.
+static int exchangeSupervision(unsigned char a, unsigned char c, unsigned char replyA, unsigned char replyC) {
+    unsigned char command[5];
+    return exchangeCommand(command, buildSupervision(command, a, c), ll.params.nRetransmissions + 1,
+                           replyA, replyC, NULL);
+}
+
 ////////////////////////////////////////////////
-// LLREAD
+// TRANSMITTER
 ////////////////////////////////////////////////
-int llread(unsigned char *packet)
-{
-    // TODO
+// sqrt() would need libm, which the build does not link.
+static double squareRoot(double x) {
+    if (x <= 0) return 0;
+    double root = x > 1 ? x : 1;
+    for (int i = 0; i < 64; i++) {
+        root = (root + x / root) / 2;
+    }
+    return root;
+}
+
+// Pick the segment size that maximizes goodput. With each byte corrupted
+// with probability q and H bytes of overhead per frame (header, BCC2, flags,
+// the acknowledgement and, for Stop-and-Wait, the idle round trip), the
+// efficiency L / (L + H) * (1 - q)^(L + H) peaks at the positive root of
+// L^2 + H L - H / q = 0. q is estimated as failed transmissions per byte sent
+// in the transmissions that could fail: Go-Back-N resends of the frames after
+// a failed one say nothing about the line, so they count neither way.
+static void adaptSegmentSize(void) {
+    long long bytes = 0;
+    int failures = 0;
+    for (int i = 0; i < ll.historyCount; i++) {
+        bytes += ll.historyBytes[i];
+        failures += ll.historyFailures[i];
+    }
+
+    double overhead = 4 + checkSize() + 1 + 5;
+    if (ll.options.arq == LlStopAndWait && ll.srtt > 0) {
+        overhead += ll.srtt * ll.params.baudRate / 10 / 1000000;
+    }
+
+    double target = ll.payloadLimit;
+    if (failures > 0) {
+        double q = (double) failures / bytes;
+        target = (squareRoot(overhead * overhead + 4 * overhead / q) - overhead) / 2;
+    }
+
+    // At most halve or double at a time, the estimate is noisy
+    int size = target;
+    if (size > 2 * ll.segmentSize) size = 2 * ll.segmentSize;
+    if (size < ll.segmentSize / 2) size = ll.segmentSize / 2;
+    if (size > ll.payloadLimit) size = ll.payloadLimit;
+    if (size < MIN_SEGMENT_SIZE) size = MIN_SEGMENT_SIZE;
+
+    ll.segmentSize = size;
+}
+
+// Record how many of the transmissions of an acknowledged frame failed.
+static void recordOutcome(const TxSlot *slot) {
+    ll.stats.frameAttempts += slot->failures + 1;
+    ll.stats.frameFailures += slot->failures;
+    ll.historyBytes[ll.historyNext] = (slot->failures + 1) * slot->frameSize;
+    ll.historyFailures[ll.historyNext] = slot->failures;
+    ll.historyNext = (ll.historyNext + 1) % ADAPT_WINDOW;
+    if (ll.historyCount < ADAPT_WINDOW) ll.historyCount++;
+
+    if (ll.segmentation && ll.historyNext % ADAPT_INTERVAL == 0) adaptSegmentSize();
+}
+
+static int outstandingFrames(void) {
+    return SEQ_DIST(ll.va, ll.vs);
+}
+
+// Every outstanding frame has its own deadline; the timer is armed for the
+// earliest one, or for llread() giving up on the peer if that comes first.
+static void scheduleTimer(void) {
+    long long earliest = ll.rxDeadline;
+    for (int ns = ll.va; ns != ll.vs; ns = SEQ_NEXT(ns)) {
+        if (earliest == 0 || ll.window[ns].deadline < earliest) earliest = ll.window[ns].deadline;
+    }
+
+    if (earliest == 0) {
+        timerStop();
+        return;
+    }
+    timerStart(earliest - monotonicUs());
+}
 
+// Size of the data field of an I-frame before stuffing.
+static int dataFieldSize(int payloadSize) {
+    int size = payloadSize + checkSize();
+    return ll.fecDepth > 0 ? (int) fecEncodedSize(size, ll.fecDepth) : size;
+}
+
+static int sendIFrame(int ns) {
+    TxSlot *slot = &ll.window[ns];
+
+    // In full duplex every transmission carries the current V(R), which makes
+    // a pending RR unnecessary. The header is never stuffed: C would be FLAG
+    // only with the P bit, used for segmentation, which full duplex goes without.
+    if (ll.duplex) {
+        slot->frame[2] = C_WITH_NR(slot->frame[2], ll.vr);
+        slot->frame[3] = slot->frame[1] ^ slot->frame[2];
+        ll.ackPending = FALSE;
+    }
+
+    int res = slot->iovCount > 0 ? writeSegments(slot->iov, slot->iovCount, slot->frameSize)
+                                 : writeAll(slot->frame, slot->frameSize);
+    if (res < 0) return -1;
+    if (slot->transmissions > 0) ll.stats.retransmissions++;
+    ll.stats.stuffingBytesSent += slot->frameSize - 5 - dataFieldSize(slot->payloadSize);
+    // The timer runs from the moment the frame is actually on the wire
+    slot->sentAt = ll.lineIdleAt;
+    slot->deadline = slot->sentAt + ll.rto;
+    slot->transmissions++;
     return 0;
 }
 
-////////////////////////////////////////////////
-// LLCLOSE
-////////////////////////////////////////////////
-int llclose(int showStatistics)
-{
-    // TODO
+// Selective Repeat: frames sent after a resent one sit in the receive buffer
+// and cannot be acknowledged before it, so their timers wait for its own.
+static int resendSelected(int ns) {
+    if (sendIFrame(ns) < 0) return -1;
 
+    long long deadline = ll.window[ns].deadline + 1;
+    for (int later = SEQ_NEXT(ns); later != ll.vs; later = SEQ_NEXT(later)) {
+        if (ll.window[later].deadline < deadline) ll.window[later].deadline = deadline;
+    }
+    return 0;
+}
+
+// Resend every unacknowledged I-frame, oldest first (Go-Back-N).
+static int resendOutstanding(void) {
+    ll.goBackFrom = ll.va;
+    ll.goBackAt = monotonicUs();
+    for (int ns = ll.va; ns != ll.vs; ns = SEQ_NEXT(ns)) {
+        if (sendIFrame(ns) < 0) return -1;
+    }
+    scheduleTimer();
+    return 0;
+}
+
+// Resend the frames whose deadline passed: only the expired ones with Selective
+// Repeat, the whole window with Go-Back-N (its timer tracks the oldest frame).
+static int handleTimeouts(void) {
+    long long now = monotonicUs();
+    int backedOff = FALSE;
+
+    for (int ns = ll.va; ns != ll.vs; ns = SEQ_NEXT(ns)) {
+        TxSlot *slot = &ll.window[ns];
+        if (slot->deadline > now) {
+            if (ll.options.arq != LlSelectiveRepeat) break;
+            continue;
+        }
+
+        slot->failures++;
+        if (++slot->retries > ll.params.nRetransmissions) {
+            printf("Maximum retransmissions reached, giving up\n");
+            // Keep the timer armed, or llclose() would wait for the window forever
+            scheduleTimer();
+            return -1;
+        }
+
+        if (!backedOff) {
+            rtoBackoff();
+            ll.stats.timeouts++;
+            backedOff = TRUE;
+        }
+
+        if (ll.options.arq != LlSelectiveRepeat) return resendOutstanding();
+        if (resendSelected(ns) < 0) return -1;
+    }
+
+    scheduleTimer();
+    return 0;
+}
+
+// TRUE if frame "ns" was retransmitted too recently for a REJ/SREJ to be about
+// that retransmission: the request crossed it on the line and is stale. An
+// answer to the retransmission itself takes about a round trip, so half of one
+// tells them apart without ignoring the REJ of a damaged retransmission.
+static int resentAfterRequest(int ns) {
+    TxSlot *slot = &ll.window[ns];
+    double srtt = ll.srtt > 0 ? ll.srtt : 0;
+    return slot->transmissions > 1 && monotonicUs() < slot->sentAt + srtt / 2;
+}
+
+// TRUE if a REJ(N(R)) cannot be about a loss not answered yet: the window was
+// resent from N(R) less than a round trip ago, so the REJ crossed that resend,
+// or frame N(R) left the port less than half a round trip ago, too recently to
+// have been missed. With W = 7 the receiver may take the duplicates of an early
+// timeout for a gap; their REJs would otherwise make the transmitter go back
+// again and again. A REJ of a damaged frame N(R) comes a round trip after it.
+static int resentWindowAfterReject(int nr) {
+    double srtt = ll.srtt > 0 ? ll.srtt : 0;
+    long long now = monotonicUs();
+    return (ll.goBackAt > 0 && nr == ll.goBackFrom && now < ll.goBackAt + srtt) ||
+           now < ll.window[nr].sentAt + srtt / 2;
+}
+
+// Retire the oldest submission, which was put in I-frames, with "result".
+static void completeSubmission(int result) {
+    Submission *submission = &ll.submissions[ll.submitHead];
+    int handle = ll.submitFirstHandle;
+    ll.submitHead = (ll.submitHead + 1) % LL_MAX_SUBMISSIONS;
+    ll.submitCount--;
+    ll.submitFramed--;
+    ll.submitFirstHandle++;
+    if (submission->callback != NULL) submission->callback(handle, result, submission->context);
+}
+
+// Take the acknowledgement of every frame before N(R), which must lie in
+// [V(A), V(S)]. Return FALSE if it does not.
+static int acknowledge(int nr) {
+    if (SEQ_DIST(ll.va, nr) > outstandingFrames()) return FALSE;
+
+    if (nr != ll.va) {
+        // Time the newest frame acknowledged, unless any frame the RR covers
+        // was retransmitted (Karn's rule): with Selective Repeat the frames
+        // after a resent one wait for it in the reorder buffer, so their
+        // acknowledgement says nothing about the round trip
+        int resent = FALSE;
+        for (int ns = ll.va; ns != nr; ns = SEQ_NEXT(ns)) {
+            if (ll.window[ns].transmissions > 1) resent = TRUE;
+        }
+        TxSlot *newest = &ll.window[SEQ_PREV(nr)];
+        if (!resent) rtoSample(monotonicUs() - newest->sentAt);
+
+        int completed = 0;
+        for (int ns = ll.va; ns != nr; ns = SEQ_NEXT(ns)) {
+            recordOutcome(&ll.window[ns]);
+            ll.stats.payloadBytesSent += ll.window[ns].payloadSize;
+            if (ll.window[ns].endsSubmission) completed++;
+        }
+        ll.va = nr;
+        scheduleTimer();
+
+        // Callbacks run once the window is consistent, they may submit more
+        while (completed-- > 0) {
+            completeSubmission(ll.submissions[ll.submitHead].frameBytes);
+        }
+    }
+    return TRUE;
+}
+
+// Update the window with an RR, REJ or SREJ, resending what it asks for.
+// Return "0" on success or "-1" on error.
+static int handleAcknowledgement(unsigned char c) {
+    int nr = C_NR(c);
+    if (S_TYPE(c) == S_REJ) ll.stats.rejReceived++;
+    if (S_TYPE(c) == S_SREJ) ll.stats.srejReceived++;
+
+    if (S_TYPE(c) == S_SREJ) {
+        // SREJ names a single missing frame, which must still be outstanding
+        if (SEQ_DIST(ll.va, nr) >= outstandingFrames() || resentAfterRequest(nr)) {
+            ll.stats.srejIgnored++;
+            return 0;
+        }
+        ll.window[nr].failures++;
+        if (resendSelected(nr) < 0) return -1;
+        scheduleTimer();
+        return 0;
+    }
+
+    if (!acknowledge(nr)) return 0;
+
+    if (S_TYPE(c) == S_REJ && outstandingFrames() > 0) {
+        if (resentWindowAfterReject(ll.va)) {
+            ll.stats.rejIgnored++;
+            return 0;
+        }
+        ll.window[ll.va].failures++;
+        return resendOutstanding();
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////
+// RECEIVER
+////////////////////////////////////////////////
+// TRUE if N(S) is ahead of V(R) within the window, meaning frames in between
+// went missing. With W above half the modulo (Go-Back-N with W = 7) a
+// duplicate of a frame already taken may look ahead too; it then costs one
+// REJ(V(R)) per gap, which the transmitter ignores right after resending
+// from V(R) (resentWindowAfterReject()), so duplicates cannot feed a storm.
+static int isAhead(int ns) {
+    int distance = SEQ_DIST(ll.vr, ns);
+    return distance >= 1 && distance < ll.options.windowSize;
+}
+
+// Selective Repeat: keep a frame that arrived ahead of V(R) and ask once for
+// each missing frame before it.
+static void bufferOutOfOrder(int ns, const Frame *frame) {
+    RxSlot *slot = &ll.reorder[ns];
+    if (!slot->present) {
+        if (frame->data != slot->data) memcpy(slot->data, frame->data, frame->size);
+        slot->size = frame->size;
+        slot->more = ll.segmentation && (frame->c & C_MORE);
+        slot->present = TRUE;
+    }
+
+    for (int missing = ll.vr; missing != ns; missing = SEQ_NEXT(missing)) {
+        if (!ll.reorder[missing].present && !ll.reorder[missing].srejSent) {
+            sendSupervision(ll.rxAddress, C_SREJ(missing));
+            ll.reorder[missing].srejSent = TRUE;
+        }
+    }
+}
+
+// Acknowledge the frames before V(R). In full duplex the RR waits for an
+// I-frame to carry it, or until we wait for input.
+static void acknowledgeReceived(void) {
+    if (ll.duplex) {
+        ll.ackPending = TRUE;
+    } else {
+        sendSupervision(ll.rxAddress, C_RR(ll.vr));
+    }
+}
+
+// Take the next frame in sequence: advance V(R) past it and past the frames
+// Selective Repeat buffered right after it, which wait in [V(D), V(R)) to be
+// delivered, and acknowledge them.
+static void advanceReceiveWindow(void) {
+    ll.reorder[ll.vr].srejSent = FALSE;
+    ll.vr = SEQ_NEXT(ll.vr);
+    ll.vd = ll.vr;
+
+    while (ll.reorder[ll.vr].present) {
+        ll.reorder[ll.vr].srejSent = FALSE;
+        ll.vr = SEQ_NEXT(ll.vr);
+    }
+
+    ll.rejSent = FALSE;
+    acknowledgeReceived();
+}
+
+// Answer an intact I-frame that is not the next in sequence.
+static void handleOutOfSequence(int ns, const Frame *frame) {
+    if (!isAhead(ns)) {
+        // A duplicate, so our RR was lost: acknowledge again
+        ll.ackPending = FALSE;
+        sendSupervision(ll.rxAddress, C_RR(ll.vr));
+    } else if (ll.options.arq == LlSelectiveRepeat) {
+        bufferOutOfOrder(ns, frame);
+    } else if (!ll.rejSent) {
+        // A frame went missing, ask for everything from V(R) on
+        ll.ackPending = FALSE;
+        sendSupervision(ll.rxAddress, C_REJ(ll.vr));
+        ll.rejSent = TRUE;
+    }
+}
+
+// Answer an I-frame whose header is intact but whose payload failed BCC2: its
+// N(S) can be trusted, so ask for it at once instead of waiting for the
+// transmitter's timer. Every damaged copy of V(R) gets its REJ, since the
+// retransmission may be damaged too; frames ahead of it only get one per gap,
+// like intact ones. Selective Repeat asks for the damaged frame alone.
+static void rejectDamaged(const Frame *frame) {
+    int ns = C_NS(frame->c);
+    if (ns != ll.vr && !isAhead(ns)) return;
+
+    if (ll.options.arq == LlSelectiveRepeat) {
+        if (!ll.reorder[ns].present) {
+            sendSupervision(ll.rxAddress, C_SREJ(ns));
+            ll.reorder[ns].srejSent = TRUE;
+        }
+    } else if (ns == ll.vr || !ll.rejSent) {
+        ll.ackPending = FALSE;
+        sendSupervision(ll.rxAddress, C_REJ(ll.vr));
+        ll.rejSent = TRUE;
+    }
+}
+
+// Full duplex: take an I-frame that arrived outside llread(). The next one in
+// sequence is queued for llread() if there is room and nothing delivered
+// before it is still waiting in the reorder slots; otherwise it is left
+// unacknowledged, so that the peer resends it once we read.
+static void queueIFrame(const Frame *frame) {
+    if (!frame->bcc2Ok) {
+        rejectDamaged(frame);
+        return;
+    }
+
+    int ns = C_NS(frame->c);
+    if (ns != ll.vr) {
+        handleOutOfSequence(ns, frame);
+        return;
+    }
+    if (ll.vd != ll.vr || ll.rxQueueCount == RX_QUEUE_SIZE) return;
+
+    QueuedMessage *message = &ll.rxQueue[(ll.rxQueueHead + ll.rxQueueCount) % RX_QUEUE_SIZE];
+    if (frame->data != message->data) memcpy(message->data, frame->data, frame->size);
+    message->size = frame->size;
+    ll.rxQueueCount++;
+    advanceReceiveWindow();
+}
+
+////////////////////////////////////////////////
+// LLOPEN
+////////////////////////////////////////////////
+// Link parameters negotiated in SET/UA.
+typedef struct {
+    int maxPayload;   // Largest I-frame payload
+    int segmentation; // TRUE if messages may span several I-frames
+    int fecDepth;     // Interleaving depth of Reed-Solomon encoded I-frames, 0 without FEC
+    int duplex;       // TRUE if both ends send I-frames
+    int channels;     // Logical channels, 1 without multiplexing
+    int features;     // Application feature bits
+} LinkParameters;
+
+// Parameters announcing "parameters". Return the size of the field, zero if
+// they are the defaults and a plain SET/UA will do.
+static int buildParameters(unsigned char *field, const LinkParameters *parameters) {
+    int size = 0;
+    if (parameters->maxPayload > MAX_PAYLOAD_SIZE) {
+        field[size++] = P_MAX_PAYLOAD;
+        field[size++] = 2;
+        field[size++] = (parameters->maxPayload >> 8) & 0xFF;
+        field[size++] = parameters->maxPayload & 0xFF;
+    }
+    if (parameters->segmentation) {
+        field[size++] = P_SEGMENTATION;
+        field[size++] = 0;
+    }
+    if (parameters->fecDepth > 0) {
+        field[size++] = P_FEC;
+        field[size++] = 1;
+        field[size++] = parameters->fecDepth;
+    }
+    if (parameters->duplex) {
+        field[size++] = P_DUPLEX;
+        field[size++] = 0;
+    }
+    if (parameters->channels > 1) {
+        field[size++] = P_CHANNELS;
+        field[size++] = 1;
+        field[size++] = parameters->channels;
+    }
+    if (parameters->features != 0) {
+        field[size++] = P_FEATURES;
+        field[size++] = 1;
+        field[size++] = parameters->features;
+    }
+    return size;
+}
+
+// Parameters of a SET/UA; the defaults if it carries none. Unknown parameters
+// are skipped.
+static void parseParameters(const Frame *frame, LinkParameters *parameters) {
+    parameters->maxPayload = MAX_PAYLOAD_SIZE;
+    parameters->segmentation = FALSE;
+    parameters->fecDepth = 0;
+    parameters->duplex = FALSE;
+    parameters->channels = 1;
+    parameters->features = 0;
+
+    int i = 0;
+    while (i + 2 <= frame->size && i + 2 + frame->data[i + 1] <= frame->size) {
+        const unsigned char *value = frame->data + i + 2;
+        if (frame->data[i] == P_MAX_PAYLOAD && frame->data[i + 1] == 2) {
+            parameters->maxPayload = (value[0] << 8) | value[1];
+        } else if (frame->data[i] == P_SEGMENTATION) {
+            parameters->segmentation = TRUE;
+        } else if (frame->data[i] == P_FEC && frame->data[i + 1] == 1 && value[0] <= FEC_MAX_DEPTH) {
+            parameters->fecDepth = value[0] > 0 ? value[0] : 1;
+        } else if (frame->data[i] == P_DUPLEX) {
+            parameters->duplex = TRUE;
+        } else if (frame->data[i] == P_CHANNELS && frame->data[i + 1] == 1 && value[0] >= 1 &&
+                   value[0] <= LL_MAX_CHANNELS) {
+            parameters->channels = value[0];
+        } else if (frame->data[i] == P_FEATURES && frame->data[i + 1] == 1) {
+            parameters->features = value[0];
+        }
+        i += 2 + frame->data[i + 1];
+    }
+
+    if (parameters->maxPayload < MAX_PAYLOAD_SIZE) parameters->maxPayload = MAX_PAYLOAD_SIZE;
+}
+
+// Transmitter side of the connection setup. Jumbo frames, segmentation, FEC,
+// full duplex, logical channels and application features are offered in the SET for the first half of the attempts;
+// peers that do not know parameters drop such a SET, so the rest of the
+// attempts use a plain one, and then a late UA to an earlier SET does not
+// count as an agreement. Full duplex goes without segmentation: messages of
+// many frames sent both ways at once could fill both ends' buffers.
+static int establishConnection(void) {
+    int attempts = ll.params.nRetransmissions + 1;
+    Frame *reply = NULL;
+    int res = -1;
+    int offered = FALSE;
+
+    LinkParameters offer = { ll.maxPayload, ll.options.adaptiveFrameSize && !ll.options.fullDuplex,
+                             ll.options.forwardErrorCorrection ? ll.options.fecInterleaveDepth : 0,
+                             ll.options.fullDuplex, ll.options.channels, ll.options.features };
+    unsigned char field[MAX_PARAMETERS_SIZE];
+    int fieldSize = buildParameters(field, &offer);
+
+    if (fieldSize > 0) {
+        unsigned char command[FRAME_SIZE(MAX_PARAMETERS_SIZE)];
+        int offerAttempts = (attempts + 1) / 2;
+        int size = buildFrame(command, A_TX, C_SET, field, fieldSize);
+        res = exchangeCommand(command, size, offerAttempts, A_TX, C_UA, &reply);
+        offered = res > 0;
+        attempts -= offerAttempts;
+    }
+    if (res < 0 && attempts > 0) {
+        unsigned char command[5];
+        res = exchangeCommand(command, buildSupervision(command, A_TX, C_SET), attempts, A_TX, C_UA, &reply);
+    }
+    if (res < 0) return -1;
+
+    LinkParameters agreed = { MAX_PAYLOAD_SIZE, FALSE, 0, FALSE, 1, 0 };
+    if (offered) parseParameters(reply, &agreed);
+    ll.payloadLimit = agreed.maxPayload < ll.maxPayload ? agreed.maxPayload : ll.maxPayload;
+    ll.segmentation = agreed.segmentation && offer.segmentation;
+    ll.fecDepth = offer.fecDepth > 0 ? agreed.fecDepth : 0;
+    ll.duplex = agreed.duplex && offer.duplex;
+    ll.channels = agreed.channels < offer.channels ? agreed.channels : offer.channels;
+    ll.features = agreed.features & offer.features;
     return 1;
 }
+
+// Answer a SET with UA, agreeing on the smaller of both maximum payloads and
+// on segmentation and FEC, with its interleaving depth, if the SET offered
+// them. The payload limit and segmentation never go back, so they always cover
+// what the transmitter took from any earlier UA. FEC changes how I-frames are
+// read, so it follows the latest SET: the transmitter only keeps it from a UA
+// to the SET that offered it, and stops offering it once it falls back to a
+// plain SET. Full duplex, channels and features follow the latest SET too.
+// The receiver needs no option for segmentation nor FEC, but full duplex needs
+// an application that reads and writes on both ends, and channels one that
+// reads them apart, so both must ask for them; channels agree on the smaller
+// count, and features on the bits both ends offered.
+static int acceptConnection(const Frame *set) {
+    LinkParameters offer;
+    parseParameters(set, &offer);
+
+    LinkParameters agreed;
+    agreed.maxPayload = offer.maxPayload < ll.maxPayload ? offer.maxPayload : ll.maxPayload;
+    agreed.segmentation = offer.segmentation;
+    agreed.fecDepth = offer.fecDepth;
+    agreed.duplex = offer.duplex && ll.options.fullDuplex;
+    agreed.channels = offer.channels < ll.options.channels ? offer.channels : ll.options.channels;
+    agreed.features = offer.features & ll.options.features;
+    if (agreed.maxPayload > ll.payloadLimit) ll.payloadLimit = agreed.maxPayload;
+    if (agreed.segmentation) ll.segmentation = TRUE;
+    ll.fecDepth = agreed.fecDepth;
+    ll.duplex = agreed.duplex;
+    ll.channels = agreed.channels;
+    ll.features = agreed.features;
+
+    unsigned char field[MAX_PARAMETERS_SIZE];
+    int fieldSize = buildParameters(field, &agreed);
+    if (fieldSize == 0) return sendSupervision(A_TX, C_UA);
+
+    unsigned char reply[FRAME_SIZE(MAX_PARAMETERS_SIZE)];
+    return writeAll(reply, buildFrame(reply, A_TX, C_UA, field, fieldSize));
+}
+
+int llopen(LinkLayer connectionParameters) {
+    ll.params = connectionParameters;
+    ll.fd = openSerialPort(&ll.params);
+    if (ll.fd < 0) return -1;
+
+    ll.timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (ll.timerFd < 0) {
+        perror("timerfd_create");
+        closeSerialPort();
+        return -1;
+    }
+
+    ll.maxPayload = ll.options.maxPayloadSize;
+    ll.payloadLimit = MAX_PAYLOAD_SIZE;
+    ll.segmentation = FALSE;
+    ll.fecDepth = 0;
+    ll.duplex = FALSE;
+    ll.channels = 1;
+    ll.features = 0;
+    ll.txAddress = ll.params.role == LlTx ? A_TX : A_RX;
+    ll.rxAddress = ll.params.role == LlTx ? A_RX : A_TX;
+    if (allocateBuffers() < 0) {
+        printf("Out of memory for %d-byte frames\n", ll.maxPayload);
+        closeSerialPort();
+        return -1;
+    }
+
+    ll.lineIdleAt = 0;
+    ll.rxHead = 0;
+    ll.rxTail = 0;
+    ll.rxState = START;
+    ll.vs = 0;
+    ll.va = 0;
+    ll.goBackAt = 0;
+    rtoReset();
+    ll.historyCount = 0;
+    ll.historyNext = 0;
+    ll.vr = 0;
+    ll.vd = 0;
+    ll.rejSent = FALSE;
+    for (int i = 0; i < LL_SEQ_MODULO; i++) {
+        ll.reorder[i].present = FALSE;
+        ll.reorder[i].srejSent = FALSE;
+    }
+    ll.discReceived = FALSE;
+    ll.rxDeadline = 0;
+    ll.ackPending = FALSE;
+    ll.rxQueueHead = 0;
+    ll.rxQueueCount = 0;
+    ll.submitHead = 0;
+    ll.submitCount = 0;
+    ll.submitFramed = 0;
+    ll.submitFirstHandle = 1;
+    ll.submitFailedHandle = 0;
+    statsReset(&ll.stats, ll.params.baudRate, ll.options.windowSize, ll.options.arq == LlSelectiveRepeat,
+               monotonicUs());
+
+    if (ll.params.role == LlTx) {
+        if (establishConnection() < 0) {
+            printf("Failed to establish connection\n");
+            closeSerialPort();
+            return -1;
+        }
+    } else {
+        Frame *frame;
+        do {
+            if (receiveFrame(&frame) < 0) {
+                closeSerialPort();
+                return -1;
+            }
+        } while (frame->a != A_TX || frame->c != C_SET || !frame->bcc2Ok);
+
+        if (acceptConnection(frame) < 0) {
+            closeSerialPort();
+            return -1;
+        }
+    }
+
+    ll.stats.startUs = monotonicUs();
+    ll.segmentSize = ll.payloadLimit < MAX_PAYLOAD_SIZE ? ll.payloadLimit : MAX_PAYLOAD_SIZE;
+    ll.rto = clampRto(ll.rto + acknowledgementDelay());
+
+    if (ll.payloadLimit > MAX_PAYLOAD_SIZE || ll.segmentation || ll.fecDepth > 0 || ll.duplex || ll.channels > 1) {
+        printf("Connection established, frames of up to %d bytes%s", ll.payloadLimit,
+               ll.segmentation ? ", adaptive frame size" : "");
+        if (ll.fecDepth > 0) printf(", Reed-Solomon FEC interleaved %d deep", ll.fecDepth);
+        if (ll.duplex) printf(", full duplex");
+        if (ll.channels > 1) printf(", %d logical channels", ll.channels);
+        printf("\n");
+    } else {
+        printf("Connection established\n");
+    }
+    return 1;
+}
+
+////////////////////////////////////////////////
+// LLWRITE
+////////////////////////////////////////////////
+// Full duplex: handle a frame of the peer's own transfer met while waiting for
+// acknowledgements. Return TRUE if the frame was one.
+static int handlePeerFrame(const Frame *frame) {
+    if (frame->a == ll.rxAddress && IS_I_FRAME(frame->c)) {
+        if (frame->bcc2Ok) acknowledge(C_NR(frame->c));
+        queueIFrame(frame);
+        return TRUE;
+    }
+    if (ll.params.role == LlRx && frame->a == A_TX && frame->c == C_SET) {
+        // Our UA was lost and the transmitter is still opening the connection
+        if (frame->bcc2Ok) acceptConnection(frame);
+        return TRUE;
+    }
+    if (ll.params.role == LlRx && frame->a == A_TX && frame->c == C_DISC) {
+        ll.discReceived = TRUE;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+// Handle a frame received while I-frames are outstanding.
+// Return "0" on success or "-1" on error.
+static int handleWriterFrame(const Frame *frame) {
+    if (ll.duplex && handlePeerFrame(frame)) return 0;
+    if (frame->a != ll.txAddress || !IS_S_FRAME(frame->c)) return 0;
+    return handleAcknowledgement(frame->c);
+}
+
+// Wait for one acknowledgement (or a timeout) and update the window.
+// Return "0" on success or "-1" on error or when retransmissions are exhausted.
+static int processAcknowledgement(void) {
+    Frame *frame;
+    int res = receiveFrame(&frame);
+    if (res < 0) return -1;
+    if (res == 0) return handleTimeouts();
+    return handleWriterFrame(frame);
+}
+
+// Wait until every I-frame sent so far is acknowledged.
+static int drainWindow(void) {
+    while (outstandingFrames() > 0) {
+        if (processAcknowledgement() < 0) return -1;
+    }
+    return 0;
+}
+
+// Put a segment of a message in the next I-frame and send it; the window must
+// have room. The frame references "buf" in place if "inPlace" allows it.
+// Return the size of the frame or "-1" on error.
+static int sendNewFrame(const unsigned char *buf, int bufSize, int more, int inPlace) {
+    int ns = ll.vs;
+    unsigned char c = C_I(ns) | (more ? C_MORE : 0);
+    TxSlot *slot = &ll.window[ns];
+
+    slot->frameSize = -1;
+    if (inPlace && ll.fecDepth == 0) slot->frameSize = mapIFrame(slot, c, buf, bufSize);
+    if (slot->frameSize < 0) {
+        slot->iovCount = 0;
+        slot->frameSize = buildIFrame(slot->frame, c, buf, bufSize);
+    }
+    slot->retries = 0;
+    slot->failures = 0;
+    slot->transmissions = 0;
+    slot->endsSubmission = FALSE;
+    slot->payload = buf;
+    slot->payloadSize = bufSize;
+    if (sendIFrame(ns) < 0) return -1;
+    ll.vs = SEQ_NEXT(ll.vs);
+    scheduleTimer();
+    return slot->frameSize;
+}
+
+// Copy the clean runs a frame references in place into its own stuffed frame,
+// before the caller may release the payload while the frame can still be resent.
+static void copyIFrame(TxSlot *slot) {
+    if (slot->iovCount > 0) {
+        slot->iovCount = 0;
+        slot->frameSize = buildIFrame(slot->frame, slot->frame[2], slot->payload, slot->payloadSize);
+    }
+}
+
+// Send one I-frame. Return the size of the frame or "-1" on error.
+static int sendSegment(const unsigned char *buf, int bufSize, int more) {
+    // Keep at most windowSize frames unacknowledged
+    while (outstandingFrames() >= ll.options.windowSize) {
+        if (processAcknowledgement() < 0) return -1;
+    }
+
+    // Stop-and-Wait holds on to "buf" until the frame is acknowledged, so its
+    // clean runs are sent in place. Windowed schemes return earlier and keep
+    // their own stuffed copy.
+    int ns = ll.vs;
+    TxSlot *slot = &ll.window[ns];
+    if (sendNewFrame(buf, bufSize, more, ll.options.arq == LlStopAndWait) < 0) return -1;
+
+    // Stop-and-Wait only returns once the frame is acknowledged
+    if (ll.options.arq == LlStopAndWait && drainWindow() < 0) {
+        // Resends from llclose() must not reference "buf" any longer
+        copyIFrame(slot);
+        return -1;
+    }
+
+    return slot->frameSize;
+}
+
+// Largest message llwritejumbo()/llreadjumbo() handle.
+static int messageLimit(void) {
+    return ll.segmentation ? LL_MAX_JUMBO_PAYLOAD : ll.payloadLimit;
+}
+
+// Put the next segments of the submitted messages in I-frames while the window
+// has room. The frames reference the submitted buffers in place, which stay
+// valid until their message completes; failSubmissions() copies them first.
+// Return "0" on success or "-1" on error.
+static int frameSubmissions(void) {
+    while (ll.submitFramed < ll.submitCount && outstandingFrames() < ll.options.windowSize) {
+        Submission *submission = &ll.submissions[(ll.submitHead + ll.submitFramed) % LL_MAX_SUBMISSIONS];
+        int size = submission->size - submission->framed;
+        int more = FALSE;
+        if (ll.segmentation && size > ll.segmentSize) {
+            size = ll.segmentSize;
+            more = TRUE;
+        }
+
+        int ns = ll.vs;
+        int res = sendNewFrame(submission->buf + submission->framed, size, more, TRUE);
+        if (res < 0) return -1;
+        submission->framed += size;
+        submission->frameBytes += res;
+        if (!more) {
+            ll.window[ns].endsSubmission = TRUE;
+            ll.submitFramed++;
+        }
+    }
+    return 0;
+}
+
+// Complete every pending submission with "-1", after the connection failed.
+// Their frames that are still outstanding no longer complete anything, and
+// keep their own copy for resends from llclose(), as the caller may release
+// the buffers.
+static void failSubmissions(void) {
+    for (int ns = ll.va; ns != ll.vs; ns = SEQ_NEXT(ns)) {
+        ll.window[ns].endsSubmission = FALSE;
+        copyIFrame(&ll.window[ns]);
+    }
+    if (ll.submitCount > 0 && ll.submitFailedHandle == 0) ll.submitFailedHandle = ll.submitFirstHandle;
+    ll.submitFramed = ll.submitCount;
+    while (ll.submitCount > 0) completeSubmission(-1);
+}
+
+// Take the acknowledgements, peer frames and timeouts that are due, waiting
+// up to "timeoutMs" (-1 for no limit) for the first event while frames are
+// outstanding, and frame more submissions as the window opens.
+// Return "0" on success or "-1" on error.
+static int pollEvents(int timeoutMs) {
+    int res = frameSubmissions();
+
+    ll.waitLimit = timeoutMs;
+    while (res == 0 && outstandingFrames() > 0) {
+        Frame *frame;
+        int received = receiveFrame(&frame);
+        if (received < 0) {
+            res = -1;
+        } else if (received == 0) {
+            // Nothing arrived in time: resend whatever is due and stop
+            res = handleTimeouts();
+            if (res == 0) res = frameSubmissions();
+            break;
+        } else {
+            res = handleWriterFrame(frame);
+        }
+        ll.waitLimit = 0;
+        if (res == 0) res = frameSubmissions();
+    }
+    ll.waitLimit = -1;
+
+    if (res < 0) failSubmissions();
+    return res;
+}
+
+// Wait until every submission is acknowledged.
+static int waitSubmissions(void) {
+    while (ll.submitCount > 0) {
+        if (pollEvents(-1) < 0) return -1;
+    }
+    return 0;
+}
+
+// Send a message, split in frames of the current segment size when segmentation
+// was agreed. Return the total size of the frames or "-1" on error.
+static int writePayload(const unsigned char *buf, int bufSize, int limit) {
+    if (ll.fd < 0 || (ll.params.role != LlTx && !ll.duplex) || buf == NULL || bufSize <= 0 || bufSize > limit) {
+        return -1;
+    }
+
+    // Messages keep their order: submitted ones go first
+    if (waitSubmissions() < 0) return -1;
+
+    int written = 0;
+    int offset = 0;
+    while (offset < bufSize) {
+        int size = bufSize - offset;
+        int more = FALSE;
+        if (ll.segmentation && size > ll.segmentSize) {
+            size = ll.segmentSize;
+            more = TRUE;
+        }
+
+        int res = sendSegment(buf + offset, size, more);
+        if (res < 0) return -1;
+        written += res;
+        offset += size;
+    }
+
+    return written;
+}
+
+int llwrite(const unsigned char *buf, int bufSize) {
+    return writePayload(buf, bufSize, MAX_PAYLOAD_SIZE);
+}
+
+int llwritejumbo(const unsigned char *buf, int bufSize) {
+    return writePayload(buf, bufSize, messageLimit());
+}
+
+int llsubmit(const unsigned char *buf, int bufSize, LlCompletion callback, void *context) {
+    if (ll.fd < 0 || (ll.params.role != LlTx && !ll.duplex) || buf == NULL || bufSize <= 0 ||
+        bufSize > messageLimit() || ll.submitFailedHandle != 0) {
+        return -1;
+    }
+
+    while (ll.submitCount == LL_MAX_SUBMISSIONS) {
+        if (pollEvents(-1) < 0) return -1;
+    }
+
+    Submission *submission = &ll.submissions[(ll.submitHead + ll.submitCount) % LL_MAX_SUBMISSIONS];
+    submission->buf = buf;
+    submission->size = bufSize;
+    submission->framed = 0;
+    submission->frameBytes = 0;
+    submission->callback = callback;
+    submission->context = context;
+    ll.submitCount++;
+    int handle = ll.submitFirstHandle + ll.submitCount - 1;
+
+    // Failures reach the handle through its completion
+    if (frameSubmissions() < 0) failSubmissions();
+    return handle;
+}
+
+int llpoll(int timeoutMs) {
+    if (ll.fd < 0) return -1;
+
+    int first = ll.submitFirstHandle;
+    int res = pollEvents(timeoutMs);
+    return res < 0 ? -1 : ll.submitFirstHandle - first;
+}
+
+int llwait(int handle) {
+    if (ll.fd < 0 || handle < 1 || handle >= ll.submitFirstHandle + ll.submitCount) return -1;
+
+    while (handle >= ll.submitFirstHandle) {
+        if (pollEvents(-1) < 0) break;
+    }
+    return ll.submitFailedHandle != 0 && handle >= ll.submitFailedHandle ? -1 : 1;
+}
+
+////////////////////////////////////////////////
+// LLREAD
+////////////////////////////////////////////////
+// Append the next buffered frame to the message in "packet".
+// Return "1" if more segments follow, "0" if the message is complete or "-1" on error.
+static int deliverBuffered(unsigned char *packet, int packetSize) {
+    RxSlot *slot = &ll.reorder[ll.vd];
+    int size = slot->size;
+    if (size > packetSize - ll.rxAssembled) {
+        printf("Buffered frame of %d bytes does not fit in %d\n", size, packetSize - ll.rxAssembled);
+        return -1;
+    }
+    memcpy(packet + ll.rxAssembled, slot->data, size);
+    ll.rxAssembled += size;
+    slot->present = FALSE;
+    ll.vd = SEQ_NEXT(ll.vd);
+    return slot->more;
+}
+
+// Full duplex: move the oldest queued message to "packet".
+// Return "0" (a queued message is complete) or "-1" if it does not fit.
+static int deliverQueued(unsigned char *packet, int packetSize) {
+    QueuedMessage *message = &ll.rxQueue[ll.rxQueueHead];
+    if (message->size > packetSize) {
+        printf("Queued frame of %d bytes does not fit in %d\n", message->size, packetSize);
+        return -1;
+    }
+    memcpy(packet, message->data, message->size);
+    ll.rxAssembled = message->size;
+    ll.rxQueueHead = (ll.rxQueueHead + 1) % RX_QUEUE_SIZE;
+    ll.rxQueueCount--;
+    return 0;
+}
+
+// Give up once the peer has been silent for its whole retry budget. The timer
+// also keeps running for our own outstanding frames in full duplex.
+static void watchPeer(int watch) {
+    ll.rxDeadline = watch ? monotonicUs() + ll.params.timeout * 1000000LL * (ll.params.nRetransmissions + 1) : 0;
+    scheduleTimer();
+}
+
+// Receive I-frames until the next one in sequence arrives and append it to
+// the message in "packet". In full duplex, acknowledgements of our own frames
+// are taken on the way, from S-frames and from the N(R) of the peer's I-frames.
+// Return "1" if more segments follow, "0" if the message is complete or "-1"
+// on error, timeout or disconnection.
+static int receivePacket(unsigned char *packet, int packetSize) {
+    Frame *frame;
+    watchPeer(TRUE);
+
+    while (TRUE) {
+        int res = receiveFrame(&frame);
+        if (res == 0 && monotonicUs() < ll.rxDeadline) {
+            // One of our own frames is due for retransmission
+            res = handleTimeouts() < 0 ? -1 : 1;
+            if (res > 0) continue;
+        }
+        if (res <= 0) {
+            if (res == 0) printf("Timeout waiting for I-frame\n");
+            watchPeer(FALSE);
+            return -1;
+        }
+
+        if (ll.params.role == LlRx && frame->a == A_TX && frame->c == C_SET) {
+            // Our UA was lost and the transmitter is still opening the connection
+            if (frame->bcc2Ok) acceptConnection(frame);
+            continue;
+        }
+        if (ll.params.role == LlRx && frame->a == A_TX && frame->c == C_DISC) {
+            ll.discReceived = TRUE;
+            watchPeer(FALSE);
+            return -1;
+        }
+        if (ll.duplex && frame->a == ll.txAddress && IS_S_FRAME(frame->c)) {
+            if (handleAcknowledgement(frame->c) < 0) {
+                watchPeer(FALSE);
+                return -1;
+            }
+            continue;
+        }
+        if (frame->a != ll.rxAddress || !IS_I_FRAME(frame->c)) continue;
+
+        watchPeer(TRUE);
+
+        if (!frame->bcc2Ok) {
+            rejectDamaged(frame);
+            continue;
+        }
+        if (ll.duplex) acknowledge(C_NR(frame->c));
+
+        int ns = C_NS(frame->c);
+        if (ns != ll.vr) {
+            handleOutOfSequence(ns, frame);
+            continue;
+        }
+
+        unsigned char *end = packet + ll.rxAssembled;
+        if (frame->size > packetSize - ll.rxAssembled) {
+            // Left unacknowledged: the jumbo frame was not read with llreadjumbo()
+            printf("Frame of %d bytes does not fit in %d\n", frame->size, packetSize - ll.rxAssembled);
+            watchPeer(FALSE);
+            return -1;
+        }
+        if (frame->data != end) memcpy(end, frame->data, frame->size);
+        ll.rxAssembled += frame->size;
+        advanceReceiveWindow();
+        watchPeer(FALSE);
+        return ll.segmentation && (frame->c & C_MORE);
+    }
+}
+
+static int readPayload(unsigned char *packet, int packetSize) {
+    if (ll.fd < 0 || (ll.params.role != LlRx && !ll.duplex) || packet == NULL || ll.discReceived) return -1;
+
+    ll.rxAssembled = 0;
+    if (ll.rxQueueCount > 0) {
+        if (deliverQueued(packet, packetSize) < 0) return -1;
+        ll.stats.payloadBytesReceived += ll.rxAssembled;
+        return ll.rxAssembled;
+    }
+
+    int more = TRUE;
+    while (more) {
+        if (ll.vd != ll.vr) {
+            // Frames already acknowledged but not yet delivered go first
+            more = deliverBuffered(packet, packetSize);
+        } else {
+            // The next expected frame is destuffed straight into "packet"
+            ll.rxPacket = packet;
+            ll.rxPacketSize = packetSize;
+            more = receivePacket(packet, packetSize);
+
+            // A frame left half parsed must not write to "packet" after we return
+            if (ll.rxState != START && ll.rxFrame.inPacket) ll.rxState = START;
+            ll.rxPacket = NULL;
+        }
+        if (more < 0) return -1;
+    }
+
+    ll.stats.payloadBytesReceived += ll.rxAssembled;
+    return ll.rxAssembled;
+}
+
+int llread(unsigned char *packet) {
+    return readPayload(packet, MAX_PAYLOAD_SIZE);
+}
+
+int llreadjumbo(unsigned char *packet, int packetSize) {
+    return readPayload(packet, packetSize);
+}
+
+int llmaxpayload(void) {
+    return ll.fd < 0 ? -1 : messageLimit();
+}
+
+int llfullduplex(void) {
+    return ll.fd < 0 ? -1 : ll.duplex;
+}
+
+int llchannels(void) {
+    return ll.fd < 0 ? -1 : ll.channels;
+}
+
+int llfeatures(void) {
+    return ll.fd < 0 ? -1 : ll.features;
+}
+
+const LinkStatistics *llstatistics(void) {
+    return &ll.stats;
+}
+
+////////////////////////////////////////////////
+// LLCLOSE
+////////////////////////////////////////////////
+// Receiver side of the disconnection: wait for DISC, answer with DISC and wait for UA.
+static int acceptDisconnect(void) {
+    Frame *frame;
+
+    timerStart(ll.params.timeout * 1000000LL * (ll.params.nRetransmissions + 1));
+    while (!ll.discReceived) {
+        int res = receiveFrame(&frame);
+        if (res <= 0) {
+            timerStop();
+            return -1;
+        }
+        if (frame->a != A_TX) continue;
+
+        if (frame->c == C_DISC) {
+            ll.discReceived = TRUE;
+        } else if (IS_I_FRAME(frame->c)) {
+            // Retransmission of a frame already delivered, our RR was lost
+            sendSupervision(A_TX, C_RR(ll.vr));
+        }
+    }
+    timerStop();
+
+    return exchangeSupervision(A_RX, C_DISC, A_RX, C_UA);
+}
+
+int llclose(int showStatistics) {
+    if (ll.fd < 0) return -1;
+
+    int res = 1;
+    flushAcknowledgement();
+    if (waitSubmissions() < 0) res = -1;
+
+    // In full duplex the receiver's own frames are acknowledged first too,
+    // even if the transmitter already asked to disconnect
+    if (drainWindow() < 0) res = -1;
+    timerStop();
+
+    // The transfer ends with the last acknowledgement, not with the disconnection
+    ll.stats.endUs = monotonicUs();
+
+    if (ll.params.role == LlTx) {
+        if (exchangeSupervision(A_TX, C_DISC, A_RX, C_DISC) < 0) {
+            res = -1;
+        } else if (sendSupervision(A_RX, C_UA) < 0) {
+            res = -1;
+        }
+    } else {
+        if (acceptDisconnect() < 0) res = -1;
+    }
+
+    if (res < 0) {
+        printf("Failed to close connection cleanly\n");
+    } else {
+        printf("Connection closed\n");
+    }
+    if (showStatistics) statsPrint(stdout, &ll.stats);
+
+    closeSerialPort();
+    return res;
+}
@@ -0,0 +1,205 @@
+// Link statistics.
+// The theoretical efficiency is the classic ARQ model for the measured frame
+// error ratio p and a = Tprop / Tframe, with Tprop taken from the shortest
+// round trip (which includes the acknowledgement, but not the frame itself):
+//   Stop-and-Wait and Go-Back-N, window W:  (1 - p) / (1 + 2ap) if W >= 1 + 2a,
+//                                          W(1 - p) / ((1 + 2a)(1 - p + Wp)) otherwise
+//   Selective Repeat:                      1 - p if W >= 1 + 2a, W(1 - p) / (1 + 2a) otherwise
+// The measured efficiency is the payload goodput over the line capacity, so it
+// also pays for headers, BCC2, stuffing and acknowledgements.
+
+#include "statistics.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Bits per byte on the line: start bit, 8 data bits, stop bit
+#define BITS_PER_BYTE 10
+
+// Bytes of an RR that ends a round trip
+#define ACK_FRAME_SIZE 5
+
+// Figures derived from the counters.
+typedef struct
+{
+    double seconds;
+    double goodputSent;     // Payload bytes per second
+    double goodputReceived;
+    double efficiency;      // Measured S of the busier direction
+    double theoretical;     // Theoretical S of the frames we sent, negative if unknown
+    double frameErrorRatio; // Of the I-frames we sent
+    long long rttMin;
+    double rttAvg;
+    long long rttP99;
+} Derived;
+
+static int compareRtt(const void *a, const void *b)
+{
+    long long x = *(const long long *) a;
+    long long y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+void statsReset(LinkStatistics *stats, int baudRate, int windowSize, int selectiveRepeat, long long startUs)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->baudRate = baudRate;
+    stats->windowSize = windowSize;
+    stats->selectiveRepeat = selectiveRepeat;
+    stats->startUs = startUs;
+}
+
+void statsRecordRtt(LinkStatistics *stats, long long rtt)
+{
+    if (stats->rttCount == 0 || rtt < stats->rttMin)
+    {
+        stats->rttMin = rtt;
+    }
+    stats->rttSamples[stats->rttCount % STATS_RTT_SAMPLES] = rtt;
+    stats->rttSum += rtt;
+    stats->rttCount++;
+}
+
+// 99th percentile of the samples kept, by nearest rank.
+static long long rttPercentile99(const LinkStatistics *stats)
+{
+    int count = stats->rttCount < STATS_RTT_SAMPLES ? stats->rttCount : STATS_RTT_SAMPLES;
+    long long *sorted = malloc(count * sizeof(long long));
+    if (sorted == NULL)
+    {
+        return -1;
+    }
+    memcpy(sorted, stats->rttSamples, count * sizeof(long long));
+    qsort(sorted, count, sizeof(long long), compareRtt);
+
+    int rank = (99 * count + 99) / 100;
+    long long p99 = sorted[rank - 1];
+    free(sorted);
+    return p99;
+}
+
+static double theoreticalEfficiency(const LinkStatistics *stats, double p)
+{
+    if (stats->iFramesSent == 0 || stats->rttCount == 0)
+    {
+        return -1;
+    }
+
+    double byteTime = (double) BITS_PER_BYTE / stats->baudRate;
+    double frameTime = (double) stats->iFrameBytesSent / stats->iFramesSent * byteTime;
+    double propagation = (stats->rttMin / 1e6 - ACK_FRAME_SIZE * byteTime) / 2;
+    double a = propagation > 0 ? propagation / frameTime : 0;
+    double w = stats->windowSize;
+
+    if (stats->selectiveRepeat)
+    {
+        return w >= 1 + 2 * a ? 1 - p : w * (1 - p) / (1 + 2 * a);
+    }
+    return w >= 1 + 2 * a ? (1 - p) / (1 + 2 * a * p) : w * (1 - p) / ((1 + 2 * a) * (1 - p + w * p));
+}
+
+static void derive(const LinkStatistics *stats, Derived *derived)
+{
+    memset(derived, 0, sizeof(*derived));
+    derived->seconds = (stats->endUs - stats->startUs) / 1e6;
+    if (derived->seconds > 0)
+    {
+        derived->goodputSent = stats->payloadBytesSent / derived->seconds;
+        derived->goodputReceived = stats->payloadBytesReceived / derived->seconds;
+    }
+
+    double busier = derived->goodputSent > derived->goodputReceived ? derived->goodputSent
+                                                                    : derived->goodputReceived;
+    derived->efficiency = busier * BITS_PER_BYTE / stats->baudRate;
+
+    // Only the failed transmissions of each frame: Go-Back-N also resends
+    // the intact frames behind a lost one, which says nothing about p
+    if (stats->frameAttempts > 0)
+    {
+        derived->frameErrorRatio = (double) stats->frameFailures / stats->frameAttempts;
+    }
+    derived->theoretical = theoreticalEfficiency(stats, derived->frameErrorRatio);
+
+    derived->rttMin = stats->rttMin;
+    derived->rttP99 = stats->rttCount > 0 ? rttPercentile99(stats) : 0;
+    if (stats->rttCount > 0)
+    {
+        derived->rttAvg = (double) stats->rttSum / stats->rttCount;
+    }
+}
+
+void statsPrint(FILE *out, const LinkStatistics *stats)
+{
+    Derived derived;
+    derive(stats, &derived);
+
+    fprintf(out, "Link statistics (%.3f s at %d baud)\n", derived.seconds, stats->baudRate);
+    fprintf(out, "  Frames sent:       %ld I, %ld S, %ld U\n", stats->iFramesSent, stats->sFramesSent,
+            stats->uFramesSent);
+    fprintf(out, "  Frames received:   %ld I, %ld S, %ld U\n", stats->iFramesReceived, stats->sFramesReceived,
+            stats->uFramesReceived);
+    fprintf(out, "  Retransmissions:   %ld (%ld timeouts, %ld of %ld transmissions failed)\n", stats->retransmissions,
+            stats->timeouts, stats->frameFailures, stats->frameAttempts);
+    fprintf(out, "  REJ sent/received: %ld/%ld (%ld ignored), SREJ sent/received: %ld/%ld (%ld ignored)\n",
+            stats->rejSent, stats->rejReceived, stats->rejIgnored, stats->srejSent, stats->srejReceived,
+            stats->srejIgnored);
+    fprintf(out, "  Header errors:     %ld BCC1, %ld BCC2\n", stats->bcc1Errors, stats->bcc2Errors);
+    fprintf(out, "  Wire bytes:        %lld sent (%lld stuffing), %lld received (%lld stuffing)\n",
+            stats->wireBytesSent, stats->stuffingBytesSent, stats->wireBytesReceived, stats->stuffingBytesReceived);
+    fprintf(out, "  Payload bytes:     %lld sent, %lld received\n", stats->payloadBytesSent,
+            stats->payloadBytesReceived);
+    fprintf(out, "  Goodput:           %.1f B/s sent, %.1f B/s received\n", derived.goodputSent,
+            derived.goodputReceived);
+    if (derived.theoretical >= 0)
+    {
+        fprintf(out, "  Efficiency S:      %.4f measured, %.4f theoretical (frame error ratio %.4f)\n",
+                derived.efficiency, derived.theoretical, derived.frameErrorRatio);
+    }
+    else
+    {
+        fprintf(out, "  Efficiency S:      %.4f measured\n", derived.efficiency);
+    }
+    if (stats->rttCount > 0)
+    {
+        fprintf(out, "  Round trip time:   min %.1f ms, avg %.1f ms, p99 %.1f ms (%ld samples)\n",
+                derived.rttMin / 1000.0, derived.rttAvg / 1000.0, derived.rttP99 / 1000.0, stats->rttCount);
+    }
+}
+
+void statsPrintJson(FILE *out, const LinkStatistics *stats)
+{
+    Derived derived;
+    derive(stats, &derived);
+
+    fprintf(out, "{\"seconds\":%.6f,\"baudRate\":%d,", derived.seconds, stats->baudRate);
+    fprintf(out, "\"framesSent\":{\"i\":%ld,\"s\":%ld,\"u\":%ld},", stats->iFramesSent, stats->sFramesSent,
+            stats->uFramesSent);
+    fprintf(out, "\"framesReceived\":{\"i\":%ld,\"s\":%ld,\"u\":%ld},", stats->iFramesReceived,
+            stats->sFramesReceived, stats->uFramesReceived);
+    fprintf(out, "\"retransmissions\":%ld,\"timeouts\":%ld,", stats->retransmissions, stats->timeouts);
+    fprintf(out, "\"frameAttempts\":%ld,\"frameFailures\":%ld,", stats->frameAttempts, stats->frameFailures);
+    fprintf(out, "\"rejSent\":%ld,\"rejReceived\":%ld,\"rejIgnored\":%ld,", stats->rejSent, stats->rejReceived,
+            stats->rejIgnored);
+    fprintf(out, "\"srejSent\":%ld,\"srejReceived\":%ld,\"srejIgnored\":%ld,", stats->srejSent,
+            stats->srejReceived, stats->srejIgnored);
+    fprintf(out, "\"bcc1Errors\":%ld,\"bcc2Errors\":%ld,", stats->bcc1Errors, stats->bcc2Errors);
+    fprintf(out, "\"wireBytesSent\":%lld,\"wireBytesReceived\":%lld,", stats->wireBytesSent,
+            stats->wireBytesReceived);
+    fprintf(out, "\"stuffingBytesSent\":%lld,\"stuffingBytesReceived\":%lld,", stats->stuffingBytesSent,
+            stats->stuffingBytesReceived);
+    fprintf(out, "\"payloadBytesSent\":%lld,\"payloadBytesReceived\":%lld,", stats->payloadBytesSent,
+            stats->payloadBytesReceived);
+    fprintf(out, "\"goodputSent\":%.3f,\"goodputReceived\":%.3f,", derived.goodputSent, derived.goodputReceived);
+    fprintf(out, "\"efficiency\":%.6f,", derived.efficiency);
+    if (derived.theoretical >= 0)
+    {
+        fprintf(out, "\"theoreticalEfficiency\":%.6f,", derived.theoretical);
+    }
+    else
+    {
+        fprintf(out, "\"theoreticalEfficiency\":null,");
+    }
+    fprintf(out, "\"frameErrorRatio\":%.6f,", derived.frameErrorRatio);
+    fprintf(out, "\"rtt\":{\"samples\":%ld,\"minUs\":%lld,\"avgUs\":%.1f,\"p99Us\":%lld}}\n", stats->rttCount,
+            derived.rttMin, derived.rttAvg, derived.rttP99);
+}
@@ -0,0 +1,384 @@
+// Byte stuffing kernels: scalar, SSE2 and AVX2 with runtime dispatch.
+
+#include "stuffing.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STUFFING_HAVE_X86 1
+#endif
+
+static size_t stuffBytesScalar(const unsigned char *in, size_t size, unsigned char *out)
+{
+    size_t o = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        unsigned char byte = in[i];
+        if (byte == FLAG || byte == ESC)
+        {
+            out[o++] = ESC;
+            out[o++] = byte ^ ESC_MASK;
+        }
+        else
+        {
+            out[o++] = byte;
+        }
+    }
+    return o;
+}
+
+static size_t destuffBytesScalar(const unsigned char *in, size_t size, unsigned char *out, size_t outSpace,
+                                 size_t *written, int *escaped)
+{
+    size_t i = 0;
+    size_t o = 0;
+    int esc = *escaped;
+
+    while (i < size)
+    {
+        unsigned char byte = in[i];
+        if (byte == FLAG)
+        {
+            break;
+        }
+        if (esc)
+        {
+            if (o == outSpace)
+            {
+                break;
+            }
+            out[o++] = byte ^ ESC_MASK;
+            esc = 0;
+        }
+        else if (byte == ESC)
+        {
+            esc = 1;
+        }
+        else
+        {
+            if (o == outSpace)
+            {
+                break;
+            }
+            out[o++] = byte;
+        }
+        i++;
+    }
+
+    *written = o;
+    *escaped = esc;
+    return i;
+}
+
+static size_t cleanRunScalar(const unsigned char *in, size_t size)
+{
+    size_t i = 0;
+    while (i < size && in[i] != FLAG && in[i] != ESC)
+    {
+        i++;
+    }
+    return i;
+}
+
+#ifdef STUFFING_HAVE_X86
+// Blocks without FLAG or ESC are copied with a single store; blocks with hits
+// go through the scalar code, which is also the fastest option for dense ones.
+
+__attribute__((target("sse2")))
+static size_t stuffBytesSse2(const unsigned char *in, size_t size, unsigned char *out)
+{
+    const __m128i flag = _mm_set1_epi8((char) FLAG);
+    const __m128i esc = _mm_set1_epi8((char) ESC);
+    size_t i = 0;
+    size_t o = 0;
+
+    while (i + 16 <= size)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, flag), _mm_cmpeq_epi8(v, esc)));
+        if (mask == 0)
+        {
+            _mm_storeu_si128((__m128i *) (out + o), v);
+            o += 16;
+        }
+        else
+        {
+            o += stuffBytesScalar(in + i, 16, out + o);
+        }
+        i += 16;
+    }
+
+    return o + stuffBytesScalar(in + i, size - i, out + o);
+}
+
+__attribute__((target("avx2")))
+static size_t stuffBytesAvx2(const unsigned char *in, size_t size, unsigned char *out)
+{
+    const __m256i flag = _mm256_set1_epi8((char) FLAG);
+    const __m256i esc = _mm256_set1_epi8((char) ESC);
+    size_t i = 0;
+    size_t o = 0;
+
+    while (i + 32 <= size)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (in + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, flag), _mm256_cmpeq_epi8(v, esc)));
+        if (mask == 0)
+        {
+            _mm256_storeu_si256((__m256i *) (out + o), v);
+            o += 32;
+        }
+        else
+        {
+            o += stuffBytesScalar(in + i, 32, out + o);
+        }
+        i += 32;
+    }
+
+    return o + stuffBytesScalar(in + i, size - i, out + o);
+}
+
+__attribute__((target("sse2")))
+static size_t destuffBytesSse2(const unsigned char *in, size_t size, unsigned char *out, size_t outSpace,
+                               size_t *written, int *escaped)
+{
+    const __m128i flag = _mm_set1_epi8((char) FLAG);
+    const __m128i esc = _mm_set1_epi8((char) ESC);
+    size_t i = 0;
+    size_t o = 0;
+    size_t n;
+
+    while (i + 16 <= size && o + 16 <= outSpace)
+    {
+        if (*escaped)
+        {
+            // Finish a pending escape before looking at whole blocks again
+            i += destuffBytesScalar(in + i, 1, out + o, outSpace - o, &n, escaped);
+            o += n;
+            if (*escaped)
+            {
+                break; // Followed by a flag
+            }
+            continue;
+        }
+
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, flag), _mm_cmpeq_epi8(v, esc)));
+        _mm_storeu_si128((__m128i *) (out + o), v);
+        if (mask == 0)
+        {
+            i += 16;
+            o += 16;
+            continue;
+        }
+
+        // Keep the clean prefix and destuff the rest of the block byte by byte
+        size_t clean = __builtin_ctz(mask);
+        i += clean;
+        o += clean;
+        size_t consumed = destuffBytesScalar(in + i, 16 - clean, out + o, outSpace - o, &n, escaped);
+        i += consumed;
+        o += n;
+        if (consumed < 16 - clean)
+        {
+            break; // Stopped at a flag
+        }
+    }
+
+    i += destuffBytesScalar(in + i, size - i, out + o, outSpace - o, &n, escaped);
+    *written = o + n;
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t destuffBytesAvx2(const unsigned char *in, size_t size, unsigned char *out, size_t outSpace,
+                               size_t *written, int *escaped)
+{
+    const __m256i flag = _mm256_set1_epi8((char) FLAG);
+    const __m256i esc = _mm256_set1_epi8((char) ESC);
+    size_t i = 0;
+    size_t o = 0;
+    size_t n;
+
+    while (i + 32 <= size && o + 32 <= outSpace)
+    {
+        if (*escaped)
+        {
+            // Finish a pending escape before looking at whole blocks again
+            i += destuffBytesScalar(in + i, 1, out + o, outSpace - o, &n, escaped);
+            o += n;
+            if (*escaped)
+            {
+                break; // Followed by a flag
+            }
+            continue;
+        }
+
+        __m256i v = _mm256_loadu_si256((const __m256i *) (in + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, flag), _mm256_cmpeq_epi8(v, esc)));
+        _mm256_storeu_si256((__m256i *) (out + o), v);
+        if (mask == 0)
+        {
+            i += 32;
+            o += 32;
+            continue;
+        }
+
+        // Keep the clean prefix and destuff the rest of the block byte by byte
+        size_t clean = __builtin_ctz(mask);
+        i += clean;
+        o += clean;
+        size_t consumed = destuffBytesScalar(in + i, 32 - clean, out + o, outSpace - o, &n, escaped);
+        i += consumed;
+        o += n;
+        if (consumed < 32 - clean)
+        {
+            break; // Stopped at a flag
+        }
+    }
+
+    i += destuffBytesScalar(in + i, size - i, out + o, outSpace - o, &n, escaped);
+    *written = o + n;
+    return i;
+}
+
+__attribute__((target("sse2")))
+static size_t cleanRunSse2(const unsigned char *in, size_t size)
+{
+    const __m128i flag = _mm_set1_epi8((char) FLAG);
+    const __m128i esc = _mm_set1_epi8((char) ESC);
+    size_t i = 0;
+
+    while (i + 16 <= size)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, flag), _mm_cmpeq_epi8(v, esc)));
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+
+    return i + cleanRunScalar(in + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t cleanRunAvx2(const unsigned char *in, size_t size)
+{
+    const __m256i flag = _mm256_set1_epi8((char) FLAG);
+    const __m256i esc = _mm256_set1_epi8((char) ESC);
+    size_t i = 0;
+
+    while (i + 32 <= size)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (in + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, flag),
+                                                                 _mm256_cmpeq_epi8(v, esc)));
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+        i += 32;
+    }
+
+    return i + cleanRunScalar(in + i, size - i);
+}
+#endif
+
+typedef size_t (*StuffFunction)(const unsigned char *, size_t, unsigned char *);
+typedef size_t (*DestuffFunction)(const unsigned char *, size_t, unsigned char *, size_t, size_t *, int *);
+typedef size_t (*CleanRunFunction)(const unsigned char *, size_t);
+
+static StuffFunction stuffFunction = NULL;
+static DestuffFunction destuffFunction = NULL;
+static CleanRunFunction cleanRunFunction = NULL;
+
+static int kernelSupported(StuffingKernel kernel)
+{
+    switch (kernel)
+    {
+    case StuffingScalar:
+        return 1;
+#ifdef STUFFING_HAVE_X86
+    case StuffingSse2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2");
+    case StuffingAvx2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+StuffingKernel stuffingBestKernel(void)
+{
+    if (kernelSupported(StuffingAvx2))
+    {
+        return StuffingAvx2;
+    }
+    if (kernelSupported(StuffingSse2))
+    {
+        return StuffingSse2;
+    }
+    return StuffingScalar;
+}
+
+int stuffingSelectKernel(StuffingKernel kernel)
+{
+    if (!kernelSupported(kernel))
+    {
+        return -1;
+    }
+
+    switch (kernel)
+    {
+#ifdef STUFFING_HAVE_X86
+    case StuffingSse2:
+        stuffFunction = stuffBytesSse2;
+        destuffFunction = destuffBytesSse2;
+        cleanRunFunction = cleanRunSse2;
+        break;
+    case StuffingAvx2:
+        stuffFunction = stuffBytesAvx2;
+        destuffFunction = destuffBytesAvx2;
+        cleanRunFunction = cleanRunAvx2;
+        break;
+#endif
+    default:
+        stuffFunction = stuffBytesScalar;
+        destuffFunction = destuffBytesScalar;
+        cleanRunFunction = cleanRunScalar;
+        break;
+    }
+    return 1;
+}
+
+size_t stuffBytes(const unsigned char *in, size_t size, unsigned char *out)
+{
+    if (stuffFunction == NULL)
+    {
+        stuffingSelectKernel(stuffingBestKernel());
+    }
+    return stuffFunction(in, size, out);
+}
+
+size_t destuffBytes(const unsigned char *in, size_t size, unsigned char *out, size_t outSpace,
+                    size_t *written, int *escaped)
+{
+    if (destuffFunction == NULL)
+    {
+        stuffingSelectKernel(stuffingBestKernel());
+    }
+    return destuffFunction(in, size, out, outSpace, written, escaped);
+}
+
+size_t stuffingCleanRun(const unsigned char *in, size_t size)
+{
+    if (cleanRunFunction == NULL)
+    {
+        stuffingSelectKernel(stuffingBestKernel());
+    }
+    return cleanRunFunction(in, size);
+}